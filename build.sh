@@ -6,5 +6,7 @@ else
 	DEBUG_FLAGS="-O0 -DDEBUG -Werror"
 fi
 
-cc zviewer.c -o zviewer $BUILD_FLAGS -g -Wall -Wextra -pedantic -lncursesw \
-	$CFLAGS $LDFLAGS
+cc zviewer.c -o zviewer $BUILD_FLAGS -g -Wall -Wextra -pedantic -pthread \
+	-lncursesw $CFLAGS $LDFLAGS
+cc zvtrace.c -o zvtrace.so -shared -fPIC $BUILD_FLAGS -g -Wall -Wextra -pedantic \
+	-ldl $CFLAGS $LDFLAGS
@@ -7,264 +7,5525 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
 #include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <wchar.h>
 
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
+#ifndef ZVIEWER_NO_URING
+#include <linux/io_uring.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <curses.h>
 
 #define fail_if(cond, _msg) do { \
 	if (cond) {							\
 		G.err = errno;					\
 		G.msg = _msg;						\
-		exit(-1);						\
+		fail_exit();						\
 	}								\
 } while (0)
 
+static _Noreturn void fail_exit(void);
+static _Thread_local int inWorker;
+
+/*
+ *	The forked render can't run atexit handlers, which would write escapes
+ *	into its stdout, nor call anything unsafe after forking with threads,
+ *	so it only reports to its stderr with write() and leaves with _exit().
+ */
+#define child_fail_if(cond, _msg) do { \
+	if (cond)							\
+		child_fail(_msg);					\
+} while (0)
+
+static _Noreturn void
+child_fail(const char *msg)
+{
+	char buf[256], num[16];
+	int err = errno, n = sizeof(num);
+
+	do {
+		num[--n] = '0' + err % 10;
+		err /= 10;
+	} while (err && n);
+
+	size_t len = strlen(msg);
+	len = len < sizeof(buf) - 32 ? len : sizeof(buf) - 32;
+	memcpy(buf, msg, len);
+	memcpy(buf + len, ": errno ", 8);
+	len += 8;
+	memcpy(buf + len, num + n, sizeof(num) - n);
+	len += sizeof(num) - n;
+	buf[len++] = '\n';
+
+	ssize_t ret = write(STDERR_FILENO, buf, len);
+	(void)ret;
+	_exit(127);
+}
+
+/*
+ *	Tags of I/O requests, each tag owns a buffer slot of IO_BUFSIZE bytes
+ *	and could have at most one request in flight.
+ */
+enum {
+	EV_INOTIFY,
+	EV_RENDER,
+	EV_STDERR,
+	EV_TRACE,
+	EV_SETTLE,
+	EV_POLL,
+	EV_TIMEOUT,
+	EV_CHILD,
+	EV_NR,
+};
+
+#define FILE_EVENTS	(IN_CLOSE_WRITE | IN_MODIFY)
+#define DIR_EVENTS	(IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF)
+#define DEP_EVENTS	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+#define TREE_EVENTS	(DEP_EVENTS | IN_CREATE | IN_DELETE_SELF)
+
+/*
+ *	Changes in a tree come in bursts, like a checkout or a build writing
+ *	out many files, a render is started once no more come for SETTLE_NS
+ *	but no later than SETTLE_MAX_NS since the first.
+ */
+#define SETTLE_NS	(50 * 1000 * 1000LL)
+#define SETTLE_MAX_NS	(1000 * 1000 * 1000LL)
+
+/*
+ *	A write to the file starts a speculative render, which is shown once
+ *	the file is closed, or after no more writes for SPEC_SETTLE_NS for
+ *	writers never closing it.
+ */
+#define SPEC_SETTLE_NS	(250 * 1000 * 1000LL)
+
+/* kinds of changes to the sources */
+enum {
+	CHANGE_MODIFY	= 1,	// the file is being written
+	CHANGE_WRITTEN	= 2,	// the file is closed after writing
+	CHANGE_OTHER	= 4,	// replaced files, dependencies, or polled
+};
+
+/*
+ *	Polling backs off from POLL_MIN_NS to POLL_MAX_NS while nothing
+ *	changes, and never spends more than 1 / POLL_DUTY of the time on
+ *	stating files however many there are.
+ */
+#define POLL_MIN_NS	(100 * 1000 * 1000LL)
+#define POLL_MAX_NS	(2000 * 1000 * 1000LL)
+#define POLL_DUTY	50
+#define POLL_BATCH	256		// statx requests submitted at once
+
+/* from linux/ioprio.h, which older kernel headers don't have */
+#define IOPRIO_CLASS_RT		1
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_PRIO_VALUE(class, level)	((class) << 13 | (level))
+
+/*
+ *	Dependencies are watched through their directories, a watch for each
+ *	directory however many files in it are depended on, so thousands of
+ *	them take few of the watches a user could have.
+ */
+struct watchdir {
+	int wd;
+	int tree;			// in the tree watched with -r
+	struct watchdir *next;		// in the hash bucket
+	char path[];
+};
+
+struct dep {
+	int wd;				// of the directory
+	unsigned gen;			// of the render opening it, 0 if given
+	struct dep *next;		// in the hash bucket
+	char name[];
+};
+
+/* paths reported by the trace shim, to skip watching them again */
+struct tracedpath {
+	struct dep *dep;
+	unsigned gen;
+	struct tracedpath *next;	// in the hash bucket
+	char path[];
+};
+
+/* what tells a polled file has changed, err is 0 or errno of statx */
+struct filestate {
+	uint64_t ino, size;
+	int64_t sec;
+	uint32_t nsec;
+	int err;
+};
+
+struct pollfile {
+	char *path;
+	int dir;			// in the tree, new files may show up
+	int known;			// state is valid
+	struct filestate st;
+};
+
+#define WATCH_BUCKETS	4096
+#define DEP_BUCKETS	4096
+#define TRACE_BUCKETS	4096
+#define TRACE_LIB	"zvtrace.so"
+
+#define IO_BUFSIZE	(256 * 1024)
+#define PIPE_SIZE	(1024 * 1024)
+
+struct io_event {
+	int tag;
+	ssize_t res;		// bytes read or -errno
+	char *buf;
+};
+
+#ifndef ZVIEWER_NO_URING
+struct uring {
+	int fd;
+	unsigned *sqHead, *sqTail, *sqArray;
+	unsigned sqMask, sqEntries;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead, *cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned toSubmit;
+	int fixed;		// buffers are registered
+};
+#endif
+
+struct line {
+	size_t off;		// offset into the text of the snapshot
+	size_t len;		// without the newline
+	uint64_t hash;		// of the line as rendered
+	int width;		// display width when not wrapped
+	unsigned flags;
+	uint32_t attr;		// attributes carried over from previous lines
+	size_t runs;		// index of the first attribute run
+	unsigned nruns;
+};
+
+/*
+ *	Attributes set by SGR escapes, packed as flags in the lowest byte, then
+ *	whether the foreground and background colors are set, and the 256-color
+ *	indexes of them in the highest two bytes.
+ */
+enum {
+	SGR_BOLD	= 1 << 0,
+	SGR_DIM		= 1 << 1,
+	SGR_ITALIC	= 1 << 2,
+	SGR_UNDERLINE	= 1 << 3,
+	SGR_BLINK	= 1 << 4,
+	SGR_REVERSE	= 1 << 5,
+	SGR_INVIS	= 1 << 6,
+	SGR_FG		= 1 << 8,
+	SGR_BG		= 1 << 9,
+};
+
+#define SGR_FG_SHIFT	16
+#define SGR_BG_SHIFT	24
+#define SGR_MAX_PARAMS	16
+
+/* attr applies from byte off of the line (after stripping escapes) on */
+struct run {
+	uint32_t off;
+	uint32_t attr;
+};
+
+/* state of the escape parser, see sgrTable */
+enum {
+	ST_GROUND,
+	ST_ESC,
+	ST_ESC_INTER,
+	ST_CSI,
+	ST_OSC,
+	ST_OSC_ESC,
+	ST_NR,
+};
+
+struct sgr_parser {
+	int state;
+	uint32_t attr;
+	int params[SGR_MAX_PARAMS];
+	int nparams;
+};
+
+/* state of snapshot_build() */
+struct ingest {
+	struct snapshot *s;
+	size_t textCap, runCap;
+	size_t textLen;
+	struct sgr_parser sp;
+};
+
+enum {
+	LINE_UNEVEN	= 1 << 0,	// has wide, zero-width or control chars
+	LINE_ASCII	= 1 << 1,	// no multibyte characters
+	LINE_PLAIN	= 1 << 2,	// printable ASCII only, a byte per cell
+};
+
+/* lines [oldStart, oldStart + oldLen) are replaced with the new ones */
+struct hunk {
+	size_t oldStart, oldLen;
+	size_t newStart, newLen;
+};
+
+/*
+ *	A snapshot is immutable once published by the worker. The UI thread
+ *	takes it from G.pending and retires the one it was showing, retired
+ *	snapshots are freed by the worker, which is the only one that could
+ *	still be diffing against them.
+ */
+struct snapshot {
+	char *text;		// normalized, see line_normalize()
+	struct line *lines;
+	size_t nlines;
+	struct run *runs;
+	size_t nruns;
+
+	/* changes against the previous snapshot taken by the UI */
+	struct hunk *hunks;
+	size_t nhunks;
+	size_t changed;		// line to focus on, SIZE_MAX if unchanged
+
+	/* outline, lines matching the heading pattern */
+	size_t *heads;
+	size_t nheads;
+
+	struct snapshot *next;	// on the retired list
+};
+
+/*
+ *	Diagnostics of a render, handed over to the UI like a snapshot. out is
+ *	what it printed to stderr, or to stdout if it failed printing nothing
+ *	to stderr, NULL if neither.
+ */
+struct diag {
+	int wstatus;
+	char breach[64];	// the limit it's killed for, if any
+	struct snapshot *out;
+};
+
+#define ERRLOG_SIZE	(64 * 1024)	// the tail of stderr kept
+
+#define DIFF_MAX_EDITS	1024
+
+/*
+ *	Display rows of an uneven line under the current width, valid only if
+ *	gen matches G.view.gen, so a resize invalidates all of them in O(1).
+ */
+struct rowcache {
+	unsigned gen;
+	unsigned rows;
+};
+
+/*
+ *	Column index of a long line for horizontal scrolling, marks[k] is the
+ *	last character starting at or before column k * COLIDX_STEP.
+ */
+#define COLIDX_STEP	256
+
+struct colmark {
+	size_t off;
+	int col;
+};
+
+struct colidx {
+	size_t line;
+	struct colidx *next;
+	int nmarks;
+	struct colmark marks[];
+};
+
+#define COLIDX_BUCKETS	256
+
+/* a character (or a control byte) laid out by layout_next() */
+struct glyph {
+	const char *p;
+	int len;
+	int width;
+	wchar_t wc;		// 0 for tabs and control bytes
+	int row, x;
+};
+
+struct layout {
+	const char *start, *p, *end;
+	mbstate_t ps;
+	int cols;
+	int col;		// column in the unwrapped line, for tab stops
+	int row, x;
+};
+
+struct pos {
+	size_t line;
+	int sub;		// row inside the (wrapped) line
+};
+
+/*
+ *	Display form of a line, its characters converted to curses cells and
+ *	laid out as an unwrapped line. It depends on nothing but the content,
+ *	so it is cached by the line hash and survives reloads and resizes.
+ */
+enum {
+	CELL_CHAR,
+	CELL_TAB,		// blank, doesn't wrap to the next row by itself
+	CELL_CTRL,		// shown as '^' followed by cc
+};
+
+struct cell {
+	cchar_t cc;
+	int col;		// column in the unwrapped line
+	unsigned char width;
+	unsigned char kind;
+};
+
+struct prepared {
+	uint64_t hash;
+	size_t len;
+	uint32_t attr;
+	struct prepared *hnext;			// in the hash bucket
+	struct prepared *prev, *next;		// in the LRU list
+	int ncells;
+	struct cell cells[];
+};
+
+/* what's known about a line under the current search */
+enum {
+	SEARCH_UNKNOWN,
+	SEARCH_MISS,
+	SEARCH_HIT,
+};
+
+#define SEARCH_CHUNK	(1024 * 1024)	// bytes scanned between input polls
+#define PROMPT_MAX	256
+
+/*
+ *	Search patterns with metacharacters are compiled to a Thompson NFA over
+ *	bytes, which is turned into a DFA lazily while matching, so matching is
+ *	linear in the length of the line whatever the pattern is.
+ */
+enum {
+	NS_BYTE,		// a byte in set, then out
+	NS_SPLIT,		// both out and out1, an epsilon if out1 < 0
+	NS_BOL,
+	NS_EOL,
+	NS_MATCH,
+};
+
+struct nstate {
+	int op;
+	int out, out1;
+	uint32_t set[8];
+};
+
+/* a DFA state is a set of NFA states, the transitions are filled lazily */
+struct dstate {
+	struct dstate *next[256];
+	struct dstate *hnext;
+	int match;		// NS_MATCH is reached
+	int eolMatch;		// NS_MATCH is reached at the end, -1 if unknown
+	int n;
+	int states[];
+};
+
+#define DFA_BUCKETS	1024
+#define DFA_MAX_STATES	2048	// the cache is flushed beyond this
+
+struct dfa {
+	int anchored;		// or a match could start anywhere
+	struct dstate *buckets[DFA_BUCKETS];
+	struct dstate *start[2];	// [1] at the beginning of a line
+	int nstates;
+};
+
+struct regex {
+	struct nstate *states;
+	int n, cap;
+	int start;
+
+	/* scratch space for building state sets */
+	int *set, nset;
+	int *stack;
+	unsigned *mark, gen;
+
+	struct dfa search;	// if a line matches at all
+	struct dfa longest;	// where a match starting at a position ends
+};
+
+/* a pattern to search or filter, literal unless it has metacharacters */
+struct pattern {
+	char str[PROMPT_MAX];
+	size_t len;		// 0 if unset
+	struct regex *re;	// NULL for a literal one
+};
+
+#define PREP_BUCKETS	4096
+#define PREP_MAX_CELLS	(256 * 1024)	// for all the cached lines
+#define PREP_LINE_CELLS	(16 * 1024)	// longer lines aren't cached
+
 struct {
 	const char **renderCmd;
 	int cmdLen;
+	int forceEpoll;
 
-	char **contents;
-	size_t nlines;
+	struct {
+		int fd;		// io_uring or epoll instance
+		int uring;
+		char *bufs;
+		int fds[EV_NR];
+#ifndef ZVIEWER_NO_URING
+		struct uring ring;
+#endif
+	} io;
+
+	struct {
+		pid_t pid;	// 0 if no render is running
+		int fd;
+		char *buf;
+		size_t len, cap;
+		int pending;	// source changed during the render
+		int spec;	// the render is speculative
+		int held;	// a speculative render is done but not shown
+		int wstatus;	// of the held one
+		int cancelled;	// the running render is killed
+		int diag;	// the last published one has diagnostics
+
+		int errfd;
+		char *errlog;	// ring of ERRLOG_SIZE bytes
+		size_t errlen;	// written to the ring in total
+
+		long long start;
+		size_t nlines;
+		char breach[64];	// the limit it's killed for, if any
+	} render;
+
+	/* of the render, 0 if unlimited */
+	struct {
+		long long time;		// wall-clock, in ns
+		rlim_t cpu, mem;
+		size_t output, lines;
+		int timerfd;
+	} limit;
+
+	/* of the render, the UI and the worker keep their own */
+	struct {
+		int nice, niced;
+		int policy;		// SCHED_OTHER if unchanged
+		int ioprio;		// 0 if unchanged
+		int procsfd;		// cgroup.procs to join, -1 if none
+	} sched;
+
+	struct {
+		char **env;		// of the render, NULL if not tracing
+		char fdEnv[80];		// ZVIEWER_TRACE_FD in env
+		int fd;			// -1 once all reports are read
+		unsigned gen;		// of the running render
+		char line[PIPE_BUF];
+		size_t len;		// SIZE_MAX while skipping a long line
+
+		struct tracedpath *paths[TRACE_BUCKETS];
+	} trace;
+
+	struct {
+		int enabled;
+		int fd;			// timerfd
+		int dirty;		// the polled files are to be listed again
+		long long interval;
+
+		struct pollfile *files;
+		size_t n;
+		struct statx stx[POLL_BATCH];
+		int errs[POLL_BATCH];
+#ifndef ZVIEWER_NO_URING
+		struct uring ring;
+		int uring;
+#endif
+
+		/* for the UI */
+		atomic_size_t nfiles;
+		atomic_llong cost, period;
+	} poll;
+
+	struct {
+		pthread_t thread;
+		int wakefd;		// signaled on publishing or quitting
+		int watchfd;
+		const char *path;	// of the watched file
+		const char *name;	// looked for in the directory
+		int filewd, dirwd;
+		int treewd;		// of the root with -r, -1 otherwise
+
+		int settlefd;		// timerfd
+		long long burst;	// when the unrendered changes began
+		sigset_t sigmask;	// of the UI thread, restored in renders
+		int sigfd;		// signalfd of SIGCHLD
+
+		struct watchdir *dirs[WATCH_BUCKETS];
+		struct dep *deps[DEP_BUCKETS];
+		struct snapshot *last;	// last published
+		struct snapshot *shown;	// last taken by the UI
+	} worker;
+
+	_Atomic(struct snapshot *) pending;
+	_Atomic(struct snapshot *) retired;
+	_Atomic(struct diag *) pendingDiag;
+	atomic_int quit;
+	_Atomic(pid_t) renderGroup;	// of the running render, killed on exit
+
+	/* owned by the UI thread */
+	struct snapshot *snap;
+
+	struct {
+		struct diag *d;		// of the last render, if any
+		int shown;
+	} diag;
 
 	/* we must put off error messages until curses cleans up */
 	int err;
 	char *msg;
 
 	int cursesEnabled;
-	WINDOW *pad;
-	int rowoff;
+
+	struct {
+		struct pos top;
+		struct rowcache *rows;
+		unsigned gen;
+
+		/* Fenwick tree of rows taken by lines, built on demand */
+		size_t *wrap;
+		unsigned wrapGen;
+
+		/* lines are cut at the edge instead of wrapped */
+		int chop;
+		int coloff;
+		struct colidx *colidx[COLIDX_BUCKETS];
+
+		/* line numbers are shown in a gutter of the given width */
+		int numbers;
+		int gutter;
+		int cols;		// left for the text
+
+		char msg[256];		// shown at the bottom until a key
+	} view;
+
+	struct {
+		struct pattern pat;
+		int backward;		// started with '?'
+		unsigned char *state;	// SEARCH_* of each line
+		size_t unknown, nmatches;
+		size_t up, down;	// lines in [up, down) are all known
+		size_t last;		// last match gone to, SIZE_MAX if none
+	} search;
+
+	/* only lines matching pat are viewed, if it's set */
+	struct {
+		struct pattern pat;
+		size_t *lines;		// sorted
+		size_t n;
+	} filter;
+
+	struct {
+		struct pattern pat;	// used by the worker only
+		int shown;		// as an overlay
+		size_t sel;
+	} outline;
+
+	/* a to z, and the position before the last jump to a mark */
+	struct mark {
+		int set;
+		size_t line;
+		uint64_t hash;		// to find the line if it's changed
+	} marks[27];
+
+	/* the bottom line is being edited after '/', '?', '&' or '#' */
+	struct {
+		int kind;		// 0 if there's no prompt
+		char buf[PROMPT_MAX];
+		size_t len;
+	} prompt;
+
+	struct {
+		struct prepared *buckets[PREP_BUCKETS];
+		struct prepared *head, *tail;	// most recently used first
+		size_t ncells;
+		unsigned long hits, misses;
+	} prep;
+
+	/* color pairs allocated for (fg + 1, bg + 1), -1 for the default */
+	short *pairs;
+	short npairs;
 } G;
 
+/*
+ *	Build the environment of the render with the trace shim preloaded,
+ *	which is looked for next to the executable unless ZVIEWER_TRACE_LIB
+ *	is set. ZVIEWER_TRACE_FD is filled in before each render.
+ */
+static int
+trace_init(void)
+{
+	static char exe[PATH_MAX];
+	const char *lib = getenv("ZVIEWER_TRACE_LIB");
+
+	if (!lib) {
+		ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe));
+		char *slash = len > 0 && (size_t)len < sizeof(exe) ?
+			      memrchr(exe, '/', len) : NULL;
+		if (!slash || slash + sizeof(TRACE_LIB) >= exe + sizeof(exe)) {
+			fputs("failed to locate " TRACE_LIB "\n", stderr);
+			return -1;
+		}
+
+		strcpy(slash + 1, TRACE_LIB);
+		lib = exe;
+	}
+
+	if (access(lib, R_OK)) {
+		fprintf(stderr, "failed to access %s: %s\n", lib, strerror(errno));
+		return -1;
+	}
+
+	size_t n = 0;
+	while (environ[n])
+		n++;
+
+	char **env = calloc(n + 3, sizeof(char *));
+	if (!env) {
+		perror("failed to allocate memory");
+		return -1;
+	}
+
+	/* keep what's preloaded already */
+	const char *preload = getenv("LD_PRELOAD");
+	char *p = NULL;
+	if (asprintf(&p, "LD_PRELOAD=%s%s%s", lib, preload ? ":" : "",
+		     preload ? preload : "") < 0) {
+		perror("failed to allocate memory");
+		return -1;
+	}
+
+	size_t k = 0;
+	env[k++] = p;
+	env[k++] = G.trace.fdEnv;
+	for (size_t i = 0; i < n; i++) {
+		if (strncmp(environ[i], "LD_PRELOAD=", 11) &&
+		    strncmp(environ[i], "ZVIEWER_TRACE_FD=", 17))
+			env[k++] = environ[i];
+	}
+
+	G.trace.env = env;
+	return 0;
+}
+
+/* a size with an optional K, M or G suffix */
+static int
+parse_size(const char *s, unsigned long long *size)
+{
+	char *end;
+	errno = 0;
+	*size = strtoull(s, &end, 10);
+
+	int shift = 0;
+	switch (*end) {
+	case 'G':
+		shift += 10;
+		/* fallthrough */
+	case 'M':
+		shift += 10;
+		/* fallthrough */
+	case 'K':
+		shift += 10;
+		end++;
+		break;
+	}
+
+	if (errno || end == s || *end || *size > ULLONG_MAX >> shift)
+		return -1;
+
+	*size <<= shift;
+	return 0;
+}
+
+/*
+ *	Limits of the render, given like -l time=10,mem=2G, see the man page.
+ */
+static int
+parse_limits(char *opts)
+{
+	enum { LIMIT_TIME, LIMIT_CPU, LIMIT_MEM, LIMIT_OUTPUT, LIMIT_LINES };
+	char *const tokens[] = {
+		[LIMIT_TIME]	= "time",
+		[LIMIT_CPU]	= "cpu",
+		[LIMIT_MEM]	= "mem",
+		[LIMIT_OUTPUT]	= "output",
+		[LIMIT_LINES]	= "lines",
+		NULL,
+	};
+
+	while (*opts) {
+		char *value, *end;
+		unsigned long long n = 0;
+		double secs = 0;
+		int opt = getsubopt(&opts, tokens, &value);
+
+		if (opt < 0) {
+			fprintf(stderr, "invalid limit: %s\n", value);
+			return -1;
+		} else if (!value) {
+			fprintf(stderr, "missing value of %s\n", tokens[opt]);
+			return -1;
+		}
+
+		int bad;
+		if (opt == LIMIT_TIME || opt == LIMIT_CPU) {
+			secs = strtod(value, &end);
+			bad = end == value || *end || !(secs > 0) || secs > 1e9;
+		} else {
+			bad = parse_size(value, &n) || !n;
+		}
+
+		if (bad) {
+			fprintf(stderr, "invalid value of %s: %s\n",
+				tokens[opt], value);
+			return -1;
+		}
+
+		switch (opt) {
+		case LIMIT_TIME:
+			G.limit.time = secs * 1e9;
+			break;
+		case LIMIT_CPU:
+			/* RLIMIT_CPU is in seconds */
+			G.limit.cpu = secs < 1 ? 1 : (rlim_t)secs;
+			break;
+		case LIMIT_MEM:
+			G.limit.mem = n;
+			break;
+		case LIMIT_OUTPUT:
+			G.limit.output = n;
+			break;
+		case LIMIT_LINES:
+			G.limit.lines = n;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Priority of the render, given like -P nice=10,io=idle, see the man page.
+ */
+static int
+parse_priority(char *opts, const char **cgroup, int *weight)
+{
+	enum { PRIO_NICE, PRIO_IO, PRIO_SCHED, PRIO_CGROUP, PRIO_WEIGHT };
+	char *const tokens[] = {
+		[PRIO_NICE]	= "nice",
+		[PRIO_IO]	= "io",
+		[PRIO_SCHED]	= "sched",
+		[PRIO_CGROUP]	= "cgroup",
+		[PRIO_WEIGHT]	= "weight",
+		NULL,
+	};
+
+	while (*opts) {
+		char *value, *end;
+		int opt = getsubopt(&opts, tokens, &value);
+
+		if (opt < 0) {
+			fprintf(stderr, "invalid priority: %s\n", value);
+			return -1;
+		} else if (!value) {
+			fprintf(stderr, "missing value of %s\n", tokens[opt]);
+			return -1;
+		}
+
+		long n = 0;
+		int bad = 0;
+		switch (opt) {
+		case PRIO_NICE:
+			n = strtol(value, &end, 10);
+			bad = end == value || *end || n < -20 || n > 19;
+			G.sched.nice = n;
+			G.sched.niced = 1;
+			break;
+		case PRIO_IO: {
+			/* a class, with a level from 0 to 7 for rt and be */
+			int class;
+			size_t len = strcspn(value, ":");
+			if (len == 4 && !strncmp(value, "idle", 4))
+				class = IOPRIO_CLASS_IDLE;
+			else if (len == 2 && !strncmp(value, "be", 2))
+				class = IOPRIO_CLASS_BE;
+			else if (len == 2 && !strncmp(value, "rt", 2))
+				class = IOPRIO_CLASS_RT;
+			else
+				class = -1;
+
+			if (value[len]) {
+				n = strtol(value + len + 1, &end, 10);
+				bad = end == value + len + 1 || *end ||
+				      n < 0 || n > 7 ||
+				      class == IOPRIO_CLASS_IDLE;
+			} else {
+				n = class == IOPRIO_CLASS_IDLE ? 0 : 4;
+			}
+
+			bad = bad || class < 0;
+			G.sched.ioprio = IOPRIO_PRIO_VALUE(class, n);
+			break;
+		}
+		case PRIO_SCHED:
+			if (!strcmp(value, "batch"))
+				G.sched.policy = SCHED_BATCH;
+			else if (!strcmp(value, "idle"))
+				G.sched.policy = SCHED_IDLE;
+			else
+				bad = 1;
+			break;
+		case PRIO_CGROUP:
+			*cgroup = value;
+			break;
+		case PRIO_WEIGHT:
+			n = strtol(value, &end, 10);
+			bad = end == value || *end || n < 1 || n > 10000;
+			*weight = n;
+			break;
+		}
+
+		if (bad) {
+			fprintf(stderr, "invalid value of %s: %s\n",
+				tokens[opt], value);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Create the cgroup if it doesn't exist and open its cgroup.procs for
+ *	renders to join, setting its cpu.weight first if given.
+ */
+static int
+cgroup_init(const char *cgroup, int weight)
+{
+	if (mkdir(cgroup, 0755) < 0 && errno != EEXIST)
+		goto fail;
+
+	int dirfd = open(cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		goto fail;
+
+	if (weight) {
+		int fd = openat(dirfd, "cpu.weight", O_WRONLY | O_CLOEXEC);
+		if (fd < 0) {
+			close(dirfd);
+			fprintf(stderr, "failed to set cpu.weight of %s: %s\n",
+				cgroup, errno == ENOENT ?
+				"the cpu controller isn't enabled" :
+				strerror(errno));
+			return -1;
+		}
+
+		char buf[16];
+		int len = snprintf(buf, sizeof(buf), "%d", weight);
+		int ret = write(fd, buf, len);
+		close(fd);
+		if (ret != len) {
+			close(dirfd);
+			fprintf(stderr, "failed to set cpu.weight of %s: %s\n",
+				cgroup, strerror(errno));
+			return -1;
+		}
+	}
+
+	G.sched.procsfd = openat(dirfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+	close(dirfd);
+	if (G.sched.procsfd >= 0)
+		return 0;
+
+fail:
+	fprintf(stderr, "failed to use cgroup %s: %s\n", cgroup,
+		strerror(errno));
+	return -1;
+}
+
 static void
 usage(const char *progname)
 {
-	fprintf(stderr, "USAGE:\n\t%s <FILE> <RENDER_PROG>\n", progname);
+	fprintf(stderr, "USAGE:\n\t%s [-eNprSt] [-d DEPENDENCY] [-H PATTERN] "
+			"[-l LIMITS] [-P PRIORITY] <FILE> <RENDER_PROG>\n",
+		progname);
+}
+
+#ifndef ZVIEWER_NO_URING
+static void *
+uring_map(int fd, size_t size, off_t off)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, off);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ *	Whether the kernel knows opcode op. Kernels before 5.6 have neither
+ *	the probe nor most of the opcodes, like IORING_OP_READ, and a request
+ *	of an unknown one only fails on completion.
+ */
+static int
+uring_supports(int fd, int op)
+{
+	struct io_uring_probe *p = calloc(1, sizeof(*p) +
+					  256 * sizeof(p->ops[0]));
+	if (!p)
+		return 0;
+
+	int ok = !syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+			  p, 256) &&
+		 op <= p->last_op && p->ops[op].flags & IO_URING_OP_SUPPORTED;
+	free(p);
+	return ok;
+}
+
+/* a ring to issue op with, or -1 if unusable */
+static int
+uring_init(struct uring *r, unsigned entries, int op)
+{
+	struct io_uring_params p = { 0 };
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -1;
+
+	if (!uring_supports(fd, op)) {
+		close(fd);
+		return -1;
+	}
+
+	size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqSize = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+
+	char *sq = uring_map(fd, sqSize, IORING_OFF_SQ_RING);
+	char *cq = p.features & IORING_FEAT_SINGLE_MMAP ? sq :
+		   uring_map(fd, cqSize, IORING_OFF_CQ_RING);
+	r->sqes = uring_map(fd, p.sq_entries * sizeof(struct io_uring_sqe),
+			    IORING_OFF_SQES);
+	if (!sq || !cq || !r->sqes) {
+		close(fd);
+		return -1;
+	}
+
+	r->sqHead	= (unsigned *)(sq + p.sq_off.head);
+	r->sqTail	= (unsigned *)(sq + p.sq_off.tail);
+	r->sqArray	= (unsigned *)(sq + p.sq_off.array);
+	r->sqMask	= *(unsigned *)(sq + p.sq_off.ring_mask);
+	r->sqEntries	= p.sq_entries;
+	r->cqHead	= (unsigned *)(cq + p.cq_off.head);
+	r->cqTail	= (unsigned *)(cq + p.cq_off.tail);
+	r->cqMask	= *(unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes		= (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->fd		= fd;
+
+	return fd;
+}
+
+static int
+uring_enter(struct uring *r, unsigned minComplete)
+{
+	int ret = syscall(__NR_io_uring_enter, r->fd, r->toSubmit,
+			  minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0,
+			  NULL, 0);
+	if (ret >= 0)
+		r->toSubmit -= ret;
+	return ret;
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *r)
+{
+	unsigned tail = *r->sqTail;
+	unsigned head = atomic_load_explicit((_Atomic unsigned *)r->sqHead,
+					     memory_order_acquire);
+
+	if (tail - head >= r->sqEntries)
+		fail_if(uring_enter(r, 0) < 0, "failed to submit I/O requests");
+
+	unsigned idx = tail & r->sqMask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sqArray[idx] = idx;
+	atomic_store_explicit((_Atomic unsigned *)r->sqTail, tail + 1,
+			      memory_order_release);
+	r->toSubmit++;
+
+	return sqe;
+}
+#endif
+
+static void
+io_init(void)
+{
+	G.io.bufs = mmap(NULL, EV_NR * IO_BUFSIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	fail_if(G.io.bufs == MAP_FAILED, "failed to allocate I/O buffers");
+
+#ifndef ZVIEWER_NO_URING
+	if (!G.forceEpoll) {
+		G.io.fd = uring_init(&G.io.ring, EV_NR * 2,
+					   IORING_OP_READ);
+		if (G.io.fd >= 0) {
+			/*
+			 *	Registered buffers are charged against
+			 *	RLIMIT_MEMLOCK on older kernels, plain reads are
+			 *	still fine if we are out of quota.
+			 */
+			struct iovec iovs[EV_NR];
+			for (int i = 0; i < EV_NR; i++) {
+				iovs[i].iov_base = G.io.bufs + i * IO_BUFSIZE;
+				iovs[i].iov_len  = IO_BUFSIZE;
+			}
+			G.io.ring.fixed = !syscall(__NR_io_uring_register,
+						   G.io.fd,
+						   IORING_REGISTER_BUFFERS,
+						   iovs, EV_NR);
+
+			G.io.uring = 1;
+			return;
+		}
+	}
+#endif
+
+	G.io.fd = epoll_create1(EPOLL_CLOEXEC);
+	fail_if(G.io.fd < 0, "failed to create epoll instance");
+}
+
+/*
+ *	Arm a one-shot read on fd, the data is read into the buffer slot of tag.
+ */
+static void
+io_arm(int fd, int tag)
+{
+	G.io.fds[tag] = fd;
+
+#ifndef ZVIEWER_NO_URING
+	if (G.io.uring) {
+		struct io_uring_sqe *sqe = uring_sqe(&G.io.ring);
+		sqe->opcode	= G.io.ring.fixed ? IORING_OP_READ_FIXED :
+						    IORING_OP_READ;
+		sqe->fd		= fd;
+		sqe->user_data	= tag;
+		sqe->addr	= (unsigned long)(G.io.bufs + tag * IO_BUFSIZE);
+		sqe->len	= IO_BUFSIZE;
+		sqe->buf_index	= tag;
+		return;
+	}
+#endif
+
+	struct epoll_event ev = {
+		.events		= EPOLLIN | EPOLLONESHOT,
+		.data.u32	= tag,
+	};
+	if (epoll_ctl(G.io.fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		fail_if(errno != ENOENT, "failed to wait for changes");
+		fail_if(epoll_ctl(G.io.fd, EPOLL_CTL_ADD, fd, &ev) < 0,
+			"failed to wait for changes");
+	}
+}
+
+/*
+ *	Wait for completion of armed requests. With io_uring, the re-armed
+ *	requests of the last round are submitted in the same syscall, a
+ *	round costs one syscall no matter how many fds are active.
+ */
+static int
+io_wait(struct io_event *evs, int max)
+{
+	int n = 0;
+
+#ifndef ZVIEWER_NO_URING
+	if (G.io.uring) {
+		struct uring *r = &G.io.ring;
+		if (uring_enter(r, 1) < 0) {
+			fail_if(errno != EINTR, "failed to wait for changes");
+			return 0;
+		}
+
+		unsigned head = *r->cqHead;
+		unsigned tail = atomic_load_explicit(
+					(_Atomic unsigned *)r->cqTail,
+					memory_order_acquire);
+		for (; head != tail && n < max; head++) {
+			struct io_uring_cqe *cqe = &r->cqes[head & r->cqMask];
+			int tag = cqe->user_data;
+
+			if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+				io_arm(G.io.fds[tag], tag);
+				continue;
+			}
+
+			evs[n].tag = tag;
+			evs[n].res = cqe->res;
+			evs[n].buf = G.io.bufs + tag * IO_BUFSIZE;
+			n++;
+		}
+		atomic_store_explicit((_Atomic unsigned *)r->cqHead, head,
+				      memory_order_release);
+		return n;
+	}
+#endif
+
+	struct epoll_event eevs[EV_NR];
+	int ret = epoll_wait(G.io.fd, eevs, EV_NR < max ? EV_NR : max, -1);
+	if (ret < 0) {
+		fail_if(errno != EINTR, "failed to wait for changes");
+		return 0;
+	}
+
+	for (; n < ret; n++) {
+		int tag = eevs[n].data.u32;
+		evs[n].tag = tag;
+		evs[n].buf = G.io.bufs + tag * IO_BUFSIZE;
+		evs[n].res = read(G.io.fds[tag], evs[n].buf, IO_BUFSIZE);
+		if (evs[n].res < 0)
+			evs[n].res = -errno;
+	}
+
+	return n;
+}
+
+static long long
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+render_start(void)
+{
+	int pipefds[2];
+	fail_if(pipe2(pipefds, O_CLOEXEC) < 0, "failed to create pipe");
+
+	/* a larger pipe cuts down the number of reads and wakeups */
+	fcntl(pipefds[0], F_SETPIPE_SZ, PIPE_SIZE);
+
+	int errfds[2];
+	fail_if(pipe2(errfds, O_CLOEXEC) < 0, "failed to create pipe");
+
+	if (!G.render.errlog) {
+		G.render.errlog = malloc(ERRLOG_SIZE);
+		fail_if(!G.render.errlog, "failed to run the render");
+	}
+
+	/*
+	 *	Each render gets its own pipe for reports of the trace shim, it
+	 *	ends once the render and whatever it spawns have exited, so all
+	 *	opens of a render are known when both pipes are closed.
+	 */
+	int tracefds[2] = { -1, -1 };
+	if (G.trace.env) {
+		fail_if(pipe2(tracefds, O_CLOEXEC) < 0,
+			"failed to create pipe");
+
+		/* identified too, the render may reuse the number */
+		struct stat st;
+		fail_if(fstat(tracefds[1], &st), "failed to create pipe");
+		snprintf(G.trace.fdEnv, sizeof(G.trace.fdEnv),
+			 "ZVIEWER_TRACE_FD=%d:%llu:%llu", tracefds[1],
+			 (unsigned long long)st.st_dev,
+			 (unsigned long long)st.st_ino);
+	}
+
+	int pid = fork();
+
+	fail_if(pid < 0, "failed to run the render");
+
+	if (pid) {
+		/* parent, on our side too, so it could be killed at once */
+		setpgid(pid, pid);
+		atomic_store(&G.renderGroup, pid);
+		close(pipefds[1]);
+
+		G.render.pid = pid;
+		G.render.fd  = pipefds[0];
+		G.render.len = 0;
+		G.render.nlines = 0;
+		G.render.breach[0] = '\0';
+		G.render.start = now_ns();
+		io_arm(G.render.fd, EV_RENDER);
+
+		if (G.limit.time) {
+			struct itimerspec its = {
+				.it_value = {
+					.tv_sec  = G.limit.time / 1000000000LL,
+					.tv_nsec = G.limit.time % 1000000000LL,
+				},
+			};
+			timerfd_settime(G.limit.timerfd, 0, &its, NULL);
+		}
+
+		close(errfds[1]);
+		G.render.errfd	= errfds[0];
+		G.render.errlen	= 0;
+		io_arm(G.render.errfd, EV_STDERR);
+
+		if (G.trace.env) {
+			close(tracefds[1]);
+
+			G.trace.fd  = tracefds[0];
+			G.trace.len = 0;
+			G.trace.gen++;
+			io_arm(G.trace.fd, EV_TRACE);
+		}
+	} else {
+		/*
+		 *	child (the render)
+		 *	XXX: should we redirect stdin to /dev/null?
+		 *	It runs in its own process group to be cancelled with
+		 *	whatever it spawns.
+		 */
+		setpgid(0, 0);
+		pthread_sigmask(SIG_SETMASK, &G.worker.sigmask, NULL);
+		close(STDOUT_FILENO);
+		close(STDERR_FILENO);
+
+		if (dup2(pipefds[1], STDOUT_FILENO) < 0)
+			_exit(127);
+		if (dup2(errfds[1], STDERR_FILENO) < 0)
+			_exit(127);
+
+		/* the soft limit sends SIGXCPU, the hard one SIGKILL */
+		if (G.limit.cpu) {
+			struct rlimit rl = { G.limit.cpu, G.limit.cpu + 1 };
+			child_fail_if(setrlimit(RLIMIT_CPU, &rl) < 0,
+				      "failed to limit CPU time");
+		}
+		if (G.limit.mem) {
+			struct rlimit rl = { G.limit.mem, G.limit.mem };
+			child_fail_if(setrlimit(RLIMIT_AS, &rl) < 0,
+				      "failed to limit memory");
+		}
+
+		if (G.sched.procsfd >= 0)
+			child_fail_if(write(G.sched.procsfd, "0", 1) != 1,
+				      "failed to join the cgroup");
+		if (G.sched.policy != SCHED_OTHER) {
+			struct sched_param param = { 0 };
+			child_fail_if(sched_setscheduler(0, G.sched.policy,
+							 &param),
+				      "failed to set the scheduling policy");
+		}
+		if (G.sched.niced)
+			child_fail_if(setpriority(PRIO_PROCESS, 0, G.sched.nice),
+				      "failed to set the nice value");
+		if (G.sched.ioprio)
+			child_fail_if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS,
+					      0, G.sched.ioprio),
+				      "failed to set the I/O priority");
+
+		if (G.trace.env) {
+			if (fcntl(tracefds[1], F_SETFD, 0) < 0)
+				_exit(127);
+
+			execvpe(G.renderCmd[0], (char **)G.renderCmd,
+				G.trace.env);
+			child_fail("failed to execute render");
+		}
+
+		execvp(G.renderCmd[0], (char **)G.renderCmd);
+		child_fail("failed to execute render");
+	}
+}
+
+/*
+ *	Stop the render on breaking a limit, which is reported as its failure.
+ */
+static void
+render_breach(const char *fmt, ...)
+{
+	if (!G.render.pid || G.render.cancelled || G.render.breach[0])
+		return;
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(G.render.breach, sizeof(G.render.breach), fmt, ap);
+	va_end(ap);
+
+	kill(-G.render.pid, SIGKILL);
+}
+
+static void
+render_timeout(void)
+{
+	/* the expiry may be of an earlier render */
+	if (G.render.pid && now_ns() - G.render.start >= G.limit.time)
+		render_breach("render timed out after %.1fs",
+			      G.limit.time / 1e9);
+}
+
+static void
+render_append(const char *p, size_t len)
+{
+	/* what comes after breaking a limit is thrown away */
+	if (G.render.breach[0])
+		return;
+
+	if (G.limit.output && G.render.len + len > G.limit.output) {
+		render_breach("render output exceeds %zu bytes",
+			      G.limit.output);
+		return;
+	}
+
+	if (G.limit.lines) {
+		for (const char *q = p, *end = p + len;
+		     (q = memchr(q, '\n', end - q)); q++)
+			G.render.nlines++;
+
+		if (G.render.nlines > G.limit.lines) {
+			render_breach("render output exceeds %zu lines",
+				      G.limit.lines);
+			return;
+		}
+	}
+
+	if (G.render.len + len > G.render.cap) {
+		size_t cap = G.render.cap ? G.render.cap : IO_BUFSIZE;
+		while (cap < G.render.len + len)
+			cap *= 2;
+
+		G.render.buf = realloc(G.render.buf, cap);
+		fail_if(!G.render.buf, "failed to read from the render");
+		G.render.cap = cap;
+	}
+
+	memcpy(G.render.buf + G.render.len, p, len);
+	G.render.len += len;
+}
+
+static void
+layout_init(struct layout *l, const char *p, size_t len, int cols)
+{
+	memset(l, 0, sizeof(*l));
+	l->start = p;
+	l->p	= p;
+	l->end	= p + len;
+	l->cols	= cols;
+}
+
+/* place a character of width on the row, wrapping if it doesn't fit */
+static void
+layout_place(struct layout *l, int width, int isTab, int *row, int *x)
+{
+	while (l->x >= l->cols) {
+		l->row++;
+		l->x -= l->cols;
+	}
+	if (!isTab && l->x + width > l->cols && l->x) {
+		l->row++;
+		l->x = 0;
+	}
+
+	*row	= l->row;
+	*x	= l->x;
+
+	l->x	+= width;
+	l->col	+= width;
+}
+
+/*
+ *	Lay out the next character of the line. Tabs stop at every TABSIZE
+ *	columns of the unwrapped line, control bytes are shown as ^X, and bytes
+ *	that don't form a valid character as '?'. A character wider than the
+ *	rest of a row wraps to the next one as a whole.
+ */
+static int
+layout_next(struct layout *l, struct glyph *g)
+{
+	if (l->p >= l->end)
+		return 0;
+
+	unsigned char c = *l->p;
+	g->p	= l->p;
+	g->len	= 1;
+	g->wc	= 0;
+
+	if (c == '\t') {
+		g->width = TABSIZE - l->col % TABSIZE;
+	} else if (c < 0x20 || c == 0x7f) {
+		g->width = 2;
+	} else if (c < 0x80) {
+		g->width = 1;
+		g->wc	 = c;
+	} else {
+		size_t n = mbrtowc(&g->wc, l->p, l->end - l->p, &l->ps);
+		int w = n > 0 && n <= MB_LEN_MAX ? wcwidth(g->wc) : -1;
+
+		if (w < 0) {
+			memset(&l->ps, 0, sizeof(l->ps));
+			g->wc	 = L'?';
+			g->width = 1;
+		} else {
+			g->len	 = n;
+			g->width = w;
+		}
+	}
+
+	layout_place(l, g->width, c == '\t', &g->row, &g->x);
+	l->p += g->len;
+
+	return 1;
+}
+
+/* rows taken by the laid out part, a line takes at least one */
+static int
+layout_rows(const struct layout *l)
+{
+	return l->row + (l->x > 0 ? (l->x - 1) / l->cols + 1 : 1);
+}
+
+/*
+ *	Scan for bytes with the high bit set and for control bytes, 16 bytes a
+ *	time with SSE2 or 8 bytes a time otherwise.
+ */
+static unsigned
+line_classify(const char *p, size_t len)
+{
+	const char *end = p + len;
+	int high = 0, ctrl = 0;
+
+#ifdef __SSE2__
+	const __m128i sp = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+
+	for (; end - p >= 16 && !(high && ctrl); p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+		/* signed compare, bytes >= 0x80 are also below space */
+		high |= _mm_movemask_epi8(v);
+		ctrl |= _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, sp),
+						       _mm_cmpeq_epi8(v, del)));
+	}
+#else
+	const uint64_t ones = 0x0101010101010101ULL, highs = ones * 0x80;
+
+	for (; end - p >= 8 && !(high && ctrl); p += 8) {
+		uint64_t w, d;
+		memcpy(&w, p, 8);
+		d = w ^ (ones * 0x7f);
+
+		high |= !!(w & highs);
+		ctrl |= !!(((w - ones * 0x20) & ~w & highs) |
+			   ((d - ones) & ~d & highs));
+	}
+#endif
+
+	for (; p < end; p++) {
+		unsigned char c = *p;
+		high |= c >= 0x80;
+		ctrl |= c < 0x20 || c == 0x7f;
+	}
+
+	return high ? 0 : ctrl ? LINE_ASCII : LINE_ASCII | LINE_PLAIN;
+}
+
+/* byte classes of the escape parser */
+enum {
+	BC_OTHER,
+	BC_ESC,
+	BC_BEL,
+	BC_INTER,		// 0x20 - 0x2f
+	BC_PARAM,		// 0x30 - 0x3f
+	BC_FINAL,		// 0x40 - 0x7e, except the following ones
+	BC_CSI,			// '['
+	BC_OSC,			// ']'
+	BC_ST,			// '\\'
+	BC_NR,
+};
+
+/* actions of the escape parser */
+enum {
+	ACT_NONE,
+	ACT_PRINT,
+	ACT_CLEAR,		// start of a CSI sequence
+	ACT_PARAM,
+	ACT_DISPATCH,
+};
+
+#define T(st, act)	((act) << 4 | (st))
+
+/*
+ *	Transitions of the escape parser, a subset of the DEC/ECMA-48 one.
+ *	Every escape is stripped from the output, but only SGR sequences
+ *	(CSI ... m) are interpreted.
+ */
+static const unsigned char sgrTable[ST_NR][BC_NR] = {
+	[ST_GROUND] = {
+		[BC_OTHER]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_ESC]	= T(ST_ESC,	  ACT_NONE),
+		[BC_BEL]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_INTER]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_PARAM]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_FINAL]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_CSI]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_OSC]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_ST]		= T(ST_GROUND,	  ACT_PRINT),
+	},
+	[ST_ESC] = {
+		[BC_OTHER]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_ESC]	= T(ST_ESC,	  ACT_NONE),
+		[BC_BEL]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_INTER]	= T(ST_ESC_INTER, ACT_NONE),
+		[BC_PARAM]	= T(ST_GROUND,	  ACT_NONE),
+		[BC_FINAL]	= T(ST_GROUND,	  ACT_NONE),
+		[BC_CSI]	= T(ST_CSI,	  ACT_CLEAR),
+		[BC_OSC]	= T(ST_OSC,	  ACT_NONE),
+		[BC_ST]		= T(ST_GROUND,	  ACT_NONE),
+	},
+	[ST_ESC_INTER] = {
+		[BC_OTHER]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_ESC]	= T(ST_ESC,	  ACT_NONE),
+		[BC_BEL]	= T(ST_GROUND,	  ACT_PRINT),
+		[BC_INTER]	= T(ST_ESC_INTER, ACT_NONE),
+		[BC_PARAM]	= T(ST_GROUND,	  ACT_NONE),
+		[BC_FINAL]	= T(ST_GROUND,	  ACT_NONE),
+		[BC_CSI]	= T(ST_GROUND,	  ACT_NONE),
+		[BC_OSC]	= T(ST_GROUND,	  ACT_NONE),
+		[BC_ST]		= T(ST_GROUND,	  ACT_NONE),
+	},
+	[ST_CSI] = {
+		[BC_OTHER]	= T(ST_CSI,	  ACT_NONE),
+		[BC_ESC]	= T(ST_ESC,	  ACT_NONE),
+		[BC_BEL]	= T(ST_CSI,	  ACT_NONE),
+		[BC_INTER]	= T(ST_CSI,	  ACT_NONE),
+		[BC_PARAM]	= T(ST_CSI,	  ACT_PARAM),
+		[BC_FINAL]	= T(ST_GROUND,	  ACT_DISPATCH),
+		[BC_CSI]	= T(ST_GROUND,	  ACT_DISPATCH),
+		[BC_OSC]	= T(ST_GROUND,	  ACT_DISPATCH),
+		[BC_ST]		= T(ST_GROUND,	  ACT_DISPATCH),
+	},
+	[ST_OSC] = {
+		[BC_OTHER]	= T(ST_OSC,	  ACT_NONE),
+		[BC_ESC]	= T(ST_OSC_ESC,	  ACT_NONE),
+		[BC_BEL]	= T(ST_GROUND,	  ACT_NONE),
+		[BC_INTER]	= T(ST_OSC,	  ACT_NONE),
+		[BC_PARAM]	= T(ST_OSC,	  ACT_NONE),
+		[BC_FINAL]	= T(ST_OSC,	  ACT_NONE),
+		[BC_CSI]	= T(ST_OSC,	  ACT_NONE),
+		[BC_OSC]	= T(ST_OSC,	  ACT_NONE),
+		[BC_ST]		= T(ST_OSC,	  ACT_NONE),
+	},
+	[ST_OSC_ESC] = {
+		[BC_OTHER]	= T(ST_OSC,	  ACT_NONE),
+		[BC_ESC]	= T(ST_OSC_ESC,	  ACT_NONE),
+		[BC_BEL]	= T(ST_OSC,	  ACT_NONE),
+		[BC_INTER]	= T(ST_OSC,	  ACT_NONE),
+		[BC_PARAM]	= T(ST_OSC,	  ACT_NONE),
+		[BC_FINAL]	= T(ST_OSC,	  ACT_NONE),
+		[BC_CSI]	= T(ST_OSC,	  ACT_NONE),
+		[BC_OSC]	= T(ST_OSC,	  ACT_NONE),
+		[BC_ST]		= T(ST_GROUND,	  ACT_NONE),
+	},
+};
+
+#undef T
+
+static unsigned char byteClass[256];
+
+static void
+sgr_init(void)
+{
+	for (int c = 0x20; c < 0x30; c++)
+		byteClass[c] = BC_INTER;
+	for (int c = 0x30; c < 0x40; c++)
+		byteClass[c] = BC_PARAM;
+	for (int c = 0x40; c < 0x7f; c++)
+		byteClass[c] = BC_FINAL;
+
+	byteClass['\033']	= BC_ESC;
+	byteClass['\a']	= BC_BEL;
+	byteClass['[']	= BC_CSI;
+	byteClass[']']	= BC_OSC;
+	byteClass['\\']	= BC_ST;
+}
+
+/* map a 24-bit color into the 6x6x6 cube of the 256 colors */
+static int
+sgr_rgb(int r, int g, int b)
+{
+	return 16 + 36 * ((r * 5 + 127) / 255) + 6 * ((g * 5 + 127) / 255) +
+		    ((b * 5 + 127) / 255);
+}
+
+static uint32_t
+sgr_color(uint32_t attr, int isBg, int color)
+{
+	int shift = isBg ? SGR_BG_SHIFT : SGR_FG_SHIFT;
+	uint32_t set = isBg ? SGR_BG : SGR_FG;
+
+	attr &= ~((uint32_t)0xff << shift | set);
+	if (color >= 0)
+		attr |= (uint32_t)(color & 0xff) << shift | set;
+	return attr;
+}
+
+static uint32_t
+sgr_apply(uint32_t attr, const int *params, int n)
+{
+	static const uint32_t flags[10] = {
+		[1] = SGR_BOLD,		[2] = SGR_DIM,
+		[3] = SGR_ITALIC,	[4] = SGR_UNDERLINE,
+		[5] = SGR_BLINK,	[6] = SGR_BLINK,
+		[7] = SGR_REVERSE,	[8] = SGR_INVIS,
+	};
+
+	if (!n)
+		return 0;
+
+	for (int i = 0; i < n; i++) {
+		int p = params[i];
+
+		if (p == 0) {
+			attr = 0;
+		} else if (p < 10) {
+			attr |= flags[p];
+		} else if (p == 21) {
+			attr |= SGR_UNDERLINE;
+		} else if (p == 22) {
+			attr &= ~(SGR_BOLD | SGR_DIM);
+		} else if (p >= 23 && p <= 28) {
+			attr &= ~flags[p - 20];
+		} else if ((p >= 30 && p <= 37) || (p >= 40 && p <= 47)) {
+			attr = sgr_color(attr, p >= 40, p % 10);
+		} else if ((p >= 90 && p <= 97) || (p >= 100 && p <= 107)) {
+			attr = sgr_color(attr, p >= 100, 8 + p % 10);
+		} else if (p == 39 || p == 49) {
+			attr = sgr_color(attr, p == 49, -1);
+		} else if ((p == 38 || p == 48) && i + 2 < n &&
+			   params[i + 1] == 5) {
+			attr = sgr_color(attr, p == 48, params[i + 2]);
+			i += 2;
+		} else if ((p == 38 || p == 48) && i + 4 < n &&
+			   params[i + 1] == 2) {
+			attr = sgr_color(attr, p == 48,
+					 sgr_rgb(params[i + 2], params[i + 3],
+						 params[i + 4]));
+			i += 4;
+		}
+	}
+
+	return attr;
+}
+
+static void
+run_add(struct ingest *in, struct line *line, size_t off, uint32_t attr)
+{
+	struct snapshot *s = in->s;
+	struct run *last = line->nruns ? &s->runs[s->nruns - 1] : NULL;
+
+	if (last && last->attr == attr)
+		return;
+	if (!last && !attr)
+		return;
+
+	if (last && last->off == off) {
+		last->attr = attr;
+		return;
+	}
+
+	if (s->nruns == in->runCap) {
+		in->runCap = in->runCap ? in->runCap * 2 : 1024;
+		s->runs = realloc(s->runs, sizeof(struct run) * in->runCap);
+		fail_if(!s->runs, "failed to read from the render");
+	}
+
+	s->runs[s->nruns++] = (struct run) { off, attr };
+	line->nruns++;
+}
+
+static char *
+text_reserve(struct ingest *in, size_t n)
+{
+	if (in->textLen + n > in->textCap) {
+		size_t cap = in->textCap ? in->textCap : IO_BUFSIZE;
+		while (cap < in->textLen + n)
+			cap *= 2;
+
+		in->s->text = realloc(in->s->text, cap);
+		fail_if(!in->s->text, "failed to read from the render");
+		in->textCap = cap;
+	}
+
+	return in->s->text + in->textLen;
+}
+
+/* attributes in effect at byte off of the line being normalized */
+static uint32_t
+run_attr_at(struct ingest *in, const struct line *line, size_t off)
+{
+	for (size_t k = in->s->nruns; k > line->runs; k--) {
+		if (in->s->runs[k - 1].off <= off)
+			return in->s->runs[k - 1].attr;
+	}
+	return 0;
+}
+
+/* feed c to the escape parser, returns whether c is a printed one */
+static int
+sgr_step(struct ingest *in, struct line *line, unsigned char c, size_t out)
+{
+	struct sgr_parser *sp = &in->sp;
+	unsigned char t = sgrTable[sp->state][byteClass[c]];
+
+	sp->state = t & 0xf;
+	switch (t >> 4) {
+	case ACT_PRINT:
+		return 1;
+	case ACT_CLEAR:
+		sp->nparams = 0;
+		break;
+	case ACT_PARAM:
+		if (!sp->nparams)
+			sp->params[sp->nparams++] = 0;
+		if (c == ';' || c == ':') {
+			if (sp->nparams < SGR_MAX_PARAMS)
+				sp->params[sp->nparams++] = 0;
+		} else if (c >= '0' && c <= '9') {
+			int *p = &sp->params[sp->nparams - 1];
+			*p = *p > 9999 ? *p : *p * 10 + c - '0';
+		}
+		break;
+	case ACT_DISPATCH:
+		if (c != 'm')
+			break;
+		sp->attr = sgr_apply(sp->attr, sp->params, sp->nparams);
+		run_add(in, line, out, sp->attr);
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ *	Normalize a line of the render output in a single pass: escapes are
+ *	interpreted and stripped, tabs expanded, nroff overstrikes (c BS c and
+ *	_ BS c) turned into bold and underline, a trailing CR dropped and other
+ *	control bytes escaped as ^X. Only printable characters are left, and
+ *	the width of the line is known at the end of the pass. Lines of plain
+ *	ASCII, found with a vectorized scan, are copied as they are.
+ */
+static void
+line_normalize(struct ingest *in, struct line *line, const char *src,
+	       size_t len)
+{
+	struct snapshot *s = in->s;
+	char *dst = text_reserve(in, len * TABSIZE);
+
+	line->off	= in->textLen;
+	line->attr	= in->sp.attr;
+	line->runs	= s->nruns;
+	line->nruns	= 0;
+	run_add(in, line, 0, in->sp.attr);
+
+	if (line_classify(src, len) & LINE_PLAIN) {
+		memcpy(dst, src, len);
+		line->len	= len;
+		line->width	= len;
+		line->flags	= LINE_ASCII | LINE_PLAIN;
+		in->textLen	+= len;
+		return;
+	}
+
+	unsigned flags = LINE_ASCII | LINE_PLAIN;
+	mbstate_t ps = { 0 };
+	size_t out = 0, prevOff = 0;
+	int col = 0, prevWidth = 0, hasPrev = 0, overstrike = 0;
+
+	for (size_t i = 0; i < len;) {
+		unsigned char c = src[i];
+		char esc[2], keep[MB_LEN_MAX];
+		const char *g = src + i;
+		size_t glen = 1, n = 1;
+		int width = 1;
+
+		if ((in->sp.state != ST_GROUND || c == '\033') &&
+		    !sgr_step(in, line, c, out)) {
+			i++;
+			continue;
+		}
+
+		if (c == '\b') {
+			overstrike = hasPrev;
+			i++;
+			continue;
+		} else if (c == '\r' && i + 1 == len) {
+			i++;
+			continue;
+		} else if (c == '\t') {
+			width = TABSIZE - col % TABSIZE;
+			memset(dst + out, ' ', width);
+			out += width;
+			col += width;
+			hasPrev = overstrike = 0;
+			i++;
+			continue;
+		} else if (c < 0x20 || c == 0x7f) {
+			esc[0]	= '^';
+			esc[1]	= c == 0x7f ? '?' : c + '@';
+			g	= esc;
+			glen	= width = 2;
+		} else if (c >= 0x80) {
+			wchar_t wc;
+			size_t r = mbrtowc(&wc, src + i, len - i, &ps);
+			int w = r > 0 && r <= MB_LEN_MAX ? wcwidth(wc) : -1;
+
+			if (w < 0) {
+				memset(&ps, 0, sizeof(ps));
+				g = "?";
+			} else {
+				glen = n = r;
+				width = w;
+				flags = w == 1 ? flags & ~(LINE_ASCII | LINE_PLAIN) :
+						 LINE_UNEVEN;
+			}
+		}
+		i += n;
+
+		uint32_t attr = in->sp.attr;
+		if (overstrike) {
+			const char *prev = dst + prevOff;
+			size_t prevLen = out - prevOff;
+			uint32_t prevAttr = run_attr_at(in, line, prevOff);
+			uint32_t extra;
+
+			if (prevLen == glen && !memcmp(prev, g, glen)) {
+				extra = SGR_BOLD;
+			} else if (prevLen == 1 && *prev == '_') {
+				extra = SGR_UNDERLINE;
+			} else if (glen == 1 && *g == '_') {
+				extra = SGR_UNDERLINE;
+				memcpy(keep, prev, prevLen);
+				g = keep;
+				glen = prevLen;
+				width = prevWidth;
+			} else {
+				extra = 0;
+			}
+			attr |= extra | (prevAttr & (SGR_BOLD | SGR_UNDERLINE));
+
+			/* take back the previous character and its runs */
+			while (line->nruns && s->runs[s->nruns - 1].off >= prevOff) {
+				s->nruns--;
+				line->nruns--;
+			}
+			out = prevOff;
+			col -= prevWidth;
+			overstrike = 0;
+		}
+
+		run_add(in, line, out, attr);
+		memcpy(dst + out, g, glen);
+		prevOff = out;
+		prevWidth = width;
+		hasPrev = 1;
+		out += glen;
+		col += width;
+		run_add(in, line, out, in->sp.attr);
+	}
+
+	/* don't let an unterminated sequence eat the next line */
+	in->sp.state = ST_GROUND;
+
+	line->len	= out;
+	line->width	= col;
+	line->flags	= flags;
+	in->textLen	+= out;
+}
+
+/* copy line j of old, which is normalized with the same attributes */
+static void
+line_copy(struct ingest *in, struct line *line, const struct snapshot *old,
+	  size_t j)
+{
+	const struct line *o = &old->lines[j];
+	char *dst = text_reserve(in, o->len);
+
+	memcpy(dst, old->text + o->off, o->len);
+	*line		= *o;
+	line->off	= in->textLen;
+	line->runs	= in->s->nruns;
+	line->nruns	= 0;
+	in->textLen	+= o->len;
+
+	for (unsigned k = 0; k < o->nruns; k++) {
+		const struct run *r = &old->runs[o->runs + k];
+		run_add(in, line, r->off, r->attr);
+	}
+	in->sp.attr = o->nruns ? old->runs[o->runs + o->nruns - 1].attr :
+				 o->attr;
+}
+
+static uint64_t
+hash_line(const char *p, size_t len)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ULL;
+	uint64_t h = len * k;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * k;
+		h ^= h >> 29;
+	}
+
+	uint64_t w = 0;
+	memcpy(&w, p, len);
+	h = (h ^ w) * k;
+
+	return h ^ (h >> 32);
+}
+
+static int
+line_eq(const struct line *a, const struct line *b)
+{
+	/* len is normalized, but the hash covers the raw length as well */
+	return a->hash == b->hash;
+}
+
+static void
+add_edit(struct snapshot *s, size_t x, size_t y, int isInsert)
+{
+	struct hunk *h = s->nhunks ? &s->hunks[s->nhunks - 1] : NULL;
+
+	if (!h || h->oldStart + h->oldLen != x ||
+		  h->newStart + h->newLen != y) {
+		s->hunks = realloc(s->hunks, sizeof(*h) * (s->nhunks + 1));
+		fail_if(!s->hunks, "failed to diff the output");
+
+		h = &s->hunks[s->nhunks++];
+		*h = (struct hunk) { x, 0, y, 0 };
+	}
+
+	if (isInsert)
+		h->newLen++;
+	else
+		h->oldLen++;
+}
+
+/*
+ *	Myers' O(ND) diff over lines a[0, n) and b[0, m), appending the edits
+ *	(offset by base) as hunks. Returns -1 without touching the hunks if
+ *	it takes more than DIFF_MAX_EDITS edits.
+ */
+static int
+myers_diff(struct snapshot *s, const struct line *a, size_t n,
+	   const struct line *b, size_t m, size_t base)
+{
+	long max = n + m < DIFF_MAX_EDITS ? n + m : DIFF_MAX_EDITS;
+	long *v = calloc(2 * max + 3, sizeof(long));
+	long *trace = NULL;
+	long d, x, y;
+	fail_if(!v, "failed to diff the output");
+	v += max + 1;
+
+	for (d = 0; d <= max; d++) {
+		/* keep v[-d, d] before the round for backtracking */
+		trace = realloc(trace, sizeof(long) * (d + 1) * (d + 1));
+		fail_if(!trace, "failed to diff the output");
+		memcpy(trace + d * d, v - d, sizeof(long) * (2 * d + 1));
+
+		for (long k = -d; k <= d; k += 2) {
+			if (k == -d || (k != d && v[k - 1] < v[k + 1]))
+				x = v[k + 1];
+			else
+				x = v[k - 1] + 1;
+			y = x - k;
+
+			while ((size_t)x < n && (size_t)y < m &&
+			       line_eq(&a[x], &b[y])) {
+				x++;
+				y++;
+			}
+			v[k] = x;
+
+			if ((size_t)x >= n && (size_t)y >= m)
+				goto found;
+		}
+	}
+
+	free(v - max - 1);
+	free(trace);
+	return -1;
+
+found:
+	free(v - max - 1);
+
+	/* walk back from (n, m), collecting edits in reverse order */
+	struct { long x, y; int ins; } *edits = malloc(sizeof(*edits) * (d + 1));
+	fail_if(!edits, "failed to diff the output");
+
+	x = n;
+	y = m;
+	for (long e = d; e > 0; e--) {
+		long *pv = trace + e * e + e;	// v[] before round e
+		long k = x - y;
+		int ins = k == -e || (k != e && pv[k - 1] < pv[k + 1]);
+		long px = pv[ins ? k + 1 : k - 1];
+		long py = px - (ins ? k + 1 : k - 1);
+
+		edits[e].x   = px;
+		edits[e].y   = py;
+		edits[e].ins = ins;
+		x = px;
+		y = py;
+	}
+
+	for (long e = 1; e <= d; e++)
+		add_edit(s, base + edits[e].x, base + edits[e].y, edits[e].ins);
+
+	free(edits);
+	free(trace);
+	return 0;
+}
+
+/*
+ *	Compute hunks turning old into s. Common prefix and suffix are
+ *	trimmed first, so a typical save costs time proportional to the size of
+ *	the document only for hashing, and the diff itself is proportional to
+ *	the change. Falls back to a single hunk covering the middle part if it
+ *	changes too much.
+ */
+static void
+snapshot_diff(struct snapshot *s, const struct snapshot *old)
+{
+	const struct line *oldLines = old ? old->lines : NULL;
+	size_t oldN = old ? old->nlines : 0;
+	size_t pre = 0, suf = 0;
+
+	while (pre < oldN && pre < s->nlines &&
+	       line_eq(&oldLines[pre], &s->lines[pre]))
+		pre++;
+	while (suf < oldN - pre && suf < s->nlines - pre &&
+	       line_eq(&oldLines[oldN - suf - 1],
+		       &s->lines[s->nlines - suf - 1]))
+		suf++;
+
+	size_t n = oldN - pre - suf, m = s->nlines - pre - suf;
+
+	if (!old)			// first load
+		s->changed = 0;
+	else if (pre == oldN && pre == s->nlines)
+		s->changed = SIZE_MAX;
+	else if (pre == oldN || pre == s->nlines)	// append/delete at tail
+		s->changed = s->nlines;
+	else
+		s->changed = pre;
+
+	if (!n && !m)
+		return;
+
+	if (!n || !m ||
+	    myers_diff(s, oldLines + pre, n, s->lines + pre, m, pre) < 0) {
+		s->hunks = malloc(sizeof(struct hunk));
+		fail_if(!s->hunks, "failed to diff the output");
+		s->hunks[0] = (struct hunk) { pre, n, pre, m };
+		s->nhunks = 1;
+	}
+}
+
+static void
+snapshot_free(struct snapshot *s)
+{
+	if (!s)
+		return;
+
+	free(s->text);
+	free(s->lines);
+	free(s->runs);
+	free(s->hunks);
+	free(s->heads);
+	free(s);
+}
+
+static int pattern_match(const struct pattern *pt, const char *p, size_t len);
+
+/*
+ *	Index headings of s, taking those of base over for lines out of hunks
+ *	and only matching lines in hunks against the heading pattern.
+ */
+static void
+outline_build(struct snapshot *s, const struct snapshot *base)
+{
+	size_t cap = (base ? base->nheads : 0) + 1;
+	for (size_t h = 0; h < s->nhunks; h++)
+		cap += s->hunks[h].newLen;
+
+	s->heads = malloc(sizeof(size_t) * cap);
+	fail_if(!s->heads, "failed to index headings");
+
+	size_t k = 0;
+	for (size_t h = 0; h <= s->nhunks; h++) {
+		const struct hunk *hk = h < s->nhunks ? &s->hunks[h] : NULL;
+		size_t oldEnd = hk ? hk->oldStart : base ? base->nlines : 0;
+		size_t newEnd = hk ? hk->newStart : s->nlines;
+
+		for (; base && k < base->nheads && base->heads[k] < oldEnd; k++)
+			s->heads[s->nheads++] = base->heads[k] - oldEnd + newEnd;
+
+		if (!hk)
+			break;
+
+		while (base && k < base->nheads &&
+		       base->heads[k] < hk->oldStart + hk->oldLen)
+			k++;
+
+		for (size_t i = hk->newStart; i < newEnd + hk->newLen; i++) {
+			const struct line *line = &s->lines[i];
+			if (pattern_match(&G.outline.pat, s->text + line->off,
+					  line->len))
+				s->heads[s->nheads++] = i;
+		}
+	}
+}
+
+/*
+ *	Index raw output of the render (taking it over) into a new snapshot and
+ *	diff it against base.
+ */
+static struct snapshot *
+snapshot_build(const struct snapshot *base, char *raw, size_t rawLen)
+{
+	struct snapshot *s = calloc(1, sizeof(*s));
+	fail_if(!s, "failed to read from the render");
+
+	/* lines refer to the raw output until normalized */
+	size_t cap = 0;
+	for (size_t off = 0; off < rawLen;) {
+		const char *p = raw + off;
+		const char *eol = memchr(p, '\n', rawLen - off);
+		size_t len = eol ? (size_t)(eol - p) : rawLen - off;
+
+		if (s->nlines == cap) {
+			cap = cap ? cap * 2 : 1024;
+			s->lines = realloc(s->lines, sizeof(struct line) * cap);
+			fail_if(!s->lines, "failed to read from the render");
+		}
+
+		s->lines[s->nlines++] = (struct line) {
+			.off	= off,
+			.len	= len,
+			.hash	= hash_line(p, len),
+		};
+
+		off += len + (eol != NULL);
+	}
+
+	snapshot_diff(s, base);
+
+	/*
+	 *	Only lines in hunks are new. Others are copied from base as they
+	 *	are already normalized, unless the attributes carried into them
+	 *	have changed.
+	 */
+	struct ingest in = { .s = s };
+	size_t i = 0;
+	for (size_t h = 0; h <= s->nhunks; h++) {
+		size_t end = h < s->nhunks ? s->hunks[h].newStart : s->nlines;
+
+		for (; i < end; i++) {
+			struct line *line = &s->lines[i];
+			size_t j = i - end + (h < s->nhunks ? s->hunks[h].oldStart :
+							      base->nlines);
+
+			if (base->lines[j].attr == in.sp.attr)
+				line_copy(&in, line, base, j);
+			else
+				line_normalize(&in, line, raw + line->off,
+					       line->len);
+		}
+
+		if (h < s->nhunks) {
+			for (; i < end + s->hunks[h].newLen; i++) {
+				struct line *line = &s->lines[i];
+				line_normalize(&in, line, raw + line->off,
+					       line->len);
+			}
+		}
+	}
+
+	free(raw);
+	outline_build(s, base);
+	return s;
+}
+
+/*
+ *	The worker can't exit() while the UI thread is inside curses, it hands
+ *	the error over and stops, and the UI thread exits on its behalf.
+ */
+static _Noreturn void
+fail_exit(void)
+{
+	if (inWorker) {
+		uint64_t v = 1;
+		atomic_store(&G.quit, 1);
+		ssize_t ret = write(G.worker.wakefd, &v, sizeof(v));
+		(void)ret;
+		pthread_exit(NULL);
+	}
+
+	exit(-1);
+}
+
+static void
+worker_wake(void)
+{
+	fail_if(eventfd_write(G.worker.wakefd, 1) < 0,
+		"failed to wake up the UI");
+}
+
+static void
+worker_quit(void)
+{
+	atomic_store(&G.quit, 1);
+	worker_wake();
+}
+
+/*
+ *	The render is in its own process group, out of reach of ^C and hangups
+ *	of the terminal, so it's killed when we exit.
+ */
+static void
+render_kill_group(void)
+{
+	pid_t pid = atomic_load(&G.renderGroup);
+	if (pid)
+		kill(-pid, SIGKILL);
+}
+
+/* quit through the main loop, so exit handlers run */
+static void
+handle_signal(int sig)
+{
+	(void)sig;
+	int saved = errno;
+	uint64_t v = 1;
+
+	atomic_store(&G.quit, 1);
+	ssize_t ret = write(G.worker.wakefd, &v, sizeof(v));
+	(void)ret;
+	errno = saved;
+}
+
+static int
+diag_failed(const struct diag *d)
+{
+	return !WIFEXITED(d->wstatus) || WEXITSTATUS(d->wstatus) ||
+	       d->breach[0];
+}
+
+static void
+diag_free(struct diag *d)
+{
+	if (d) {
+		snapshot_free(d->out);
+		free(d);
+	}
+}
+
+static void
+diag_publish(int wstatus, struct snapshot *out)
+{
+	struct diag *d = malloc(sizeof(*d));
+	fail_if(!d, "failed to read from the render");
+	d->wstatus = wstatus;
+	d->out = out;
+	strcpy(d->breach, G.render.breach);
+
+	/* the UI never saw the replaced one */
+	diag_free(atomic_exchange(&G.pendingDiag, d));
+	worker_wake();
+}
+
+/* take over what the render has printed to stdout */
+static char *
+render_output(size_t *len)
+{
+	char *p = G.render.buf;
+	*len = G.render.len;
+	G.render.buf = NULL;
+	G.render.cap = 0;
+	return p;
+}
+
+/* keep only the tail of stderr, a runaway render can't eat up memory */
+static void
+errlog_append(const char *p, size_t len)
+{
+	if (len > ERRLOG_SIZE) {
+		G.render.errlen += len - ERRLOG_SIZE;
+		p += len - ERRLOG_SIZE;
+		len = ERRLOG_SIZE;
+	}
+
+	size_t pos = G.render.errlen % ERRLOG_SIZE;
+	size_t n = len < ERRLOG_SIZE - pos ? len : ERRLOG_SIZE - pos;
+	memcpy(G.render.errlog + pos, p, n);
+	memcpy(G.render.errlog, p + n, len - n);
+	G.render.errlen += len;
+}
+
+/* the ring in order, starting at a whole line if it has wrapped */
+static char *
+errlog_take(size_t *len)
+{
+	size_t pos = G.render.errlen % ERRLOG_SIZE;
+	size_t n = G.render.errlen < ERRLOG_SIZE ? G.render.errlen
+						 : ERRLOG_SIZE;
+	char *p = malloc(n ? n : 1);
+	fail_if(!p, "failed to read from the render");
+
+	if (G.render.errlen <= ERRLOG_SIZE) {
+		memcpy(p, G.render.errlog, n);
+	} else {
+		memcpy(p, G.render.errlog + pos, ERRLOG_SIZE - pos);
+		memcpy(p + ERRLOG_SIZE - pos, G.render.errlog, pos);
+
+		char *eol = memchr(p, '\n', n);
+		if (eol) {
+			n -= eol + 1 - p;
+			memmove(p, eol + 1, n);
+		}
+	}
+
+	*len = n;
+	return p;
+}
+
+/*
+ *	Hand the output of a finished render over to the UI as a new snapshot,
+ *	and its diagnostics if there are any or there were last time. A failed
+ *	render leaves the last good snapshot on the screen, with its errors
+ *	shown over it, which are normalized like a snapshot as well.
+ */
+static void
+render_publish(int wstatus)
+{
+	struct diag d = { .wstatus = wstatus };
+	strcpy(d.breach, G.render.breach);
+	int failed = diag_failed(&d);
+	struct snapshot *out = NULL;
+	char *raw;
+	size_t len;
+
+	if (G.render.errlen) {
+		raw = errlog_take(&len);
+		out = snapshot_build(NULL, raw, len);
+	} else if (failed && G.render.len) {
+		raw = render_output(&len);
+		out = snapshot_build(NULL, raw, len);
+	}
+
+	if (failed || out || G.render.diag)
+		diag_publish(wstatus, out);
+	G.render.diag = failed || out;
+
+	if (failed)
+		return;
+
+	/*
+	 *	Take the unseen snapshot back if the UI hasn't picked it up,
+	 *	so the new one is diffed against what is really on the screen.
+	 */
+	struct snapshot *unseen = atomic_exchange(&G.pending, NULL);
+	if (!unseen)
+		G.worker.shown = G.worker.last;
+
+	/* the UI is done with retired ones, none of them is shown */
+	struct snapshot *s = atomic_exchange(&G.retired, NULL);
+	while (s) {
+		struct snapshot *next = s->next;
+		snapshot_free(s);
+		s = next;
+	}
+
+	raw = render_output(&len);
+	s = snapshot_build(G.worker.shown, raw, len);
+	snapshot_free(unseen);
+
+	G.worker.last = s;
+	atomic_store(&G.pending, s);
+	worker_wake();
+}
+
+/* the render has closed stdout and stderr, and has nothing to trace */
+static int
+render_done(void)
+{
+	return G.render.fd < 0 && G.render.errfd < 0 && G.trace.fd < 0;
+}
+
+/*
+ *	Called when the render has closed its output and all of its opens are
+ *	traced, collect the exit status and publish the output unless it's
+ *	cancelled or speculative. A render closing its output early is left
+ *	running, subject to the limits, until EV_CHILD tells it has exited.
+ */
+static void
+render_finish(void)
+{
+	int wstatus = 0;
+	pid_t pid = waitpid(G.render.pid, &wstatus, WNOHANG);
+	fail_if(pid < 0, "failed to read from the render");
+	if (!pid)
+		return;
+	G.render.pid = 0;
+	atomic_store(&G.renderGroup, 0);
+
+	if (G.render.cancelled) {
+		G.render.cancelled = 0;
+	} else if (G.render.spec) {
+		G.render.held = 1;
+		G.render.wstatus = wstatus;
+	} else {
+		render_publish(wstatus);
+	}
+
+	if (G.render.pending) {
+		G.render.pending = 0;
+		render_start();
+	}
+}
+
+/*
+ *	Kill the running render with whatever it spawns, its output is thrown
+ *	away once it's closed. A held one is dropped as well.
+ */
+static void
+render_cancel(void)
+{
+	if (G.render.pid && !G.render.cancelled) {
+		kill(-G.render.pid, SIGKILL);
+		G.render.cancelled = 1;
+	}
+	G.render.held = 0;
+}
+
+/* show the speculative render, now or once it's done */
+static void
+render_commit(void)
+{
+	struct itimerspec its = { 0 };
+	timerfd_settime(G.worker.settlefd, 0, &its, NULL);
+
+	G.render.spec = 0;
+	if (G.render.held) {
+		G.render.held = 0;
+		render_publish(G.render.wstatus);
+	}
+}
+
+/*
+ *	The viewport works on indexes of viewed lines, which are lines of the
+ *	snapshot unless they are filtered.
+ */
+static size_t
+view_nlines(void)
+{
+	return G.filter.pat.len ? G.filter.n : G.snap->nlines;
+}
+
+static size_t
+view_line(size_t k)
+{
+	return G.filter.pat.len ? G.filter.lines[k] : k;
+}
+
+/* index of the first viewed line at or after line i of the snapshot */
+static size_t
+view_index(size_t i)
+{
+	if (!G.filter.pat.len)
+		return i;
+
+	size_t lo = 0, hi = G.filter.n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (G.filter.lines[mid] < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* line of the snapshot at the top of the screen */
+static size_t
+top_line(void)
+{
+	size_t k = G.view.top.line;
+	return k < view_nlines() ? view_line(k) : G.snap->nlines;
+}
+
+/*
+ *	Rows taken by line i on the screen. Uneven lines are laid out when
+ *	first needed after a load or resize, so resizing costs only the lines
+ *	on the screen.
+ */
+static int
+line_rows(size_t i)
+{
+	const struct line *line = &G.snap->lines[i];
+	if (G.view.chop)
+		return 1;
+	if (!(line->flags & LINE_UNEVEN))
+		return line->width ? (line->width - 1) / G.view.cols + 1 : 1;
+
+	struct rowcache *rc = &G.view.rows[i];
+	if (rc->gen == G.view.gen)
+		return rc->rows;
+
+	struct layout l;
+	struct glyph g;
+	layout_init(&l, G.snap->text + line->off, line->len, G.view.cols);
+	while (layout_next(&l, &g))
+		;
+
+	rc->gen  = G.view.gen;
+	rc->rows = layout_rows(&l);
+	return rc->rows;
+}
+
+/* rows taken by viewed line k */
+static int
+view_rows(size_t k)
+{
+	return line_rows(view_line(k));
+}
+
+/*
+ *	(Re)build the wrap index for the current width. It costs no layout
+ *	but for uneven lines and is only done when a lookup needs it, so
+ *	neither a reload nor a resize pays for it.
+ */
+static void
+wrap_build(void)
+{
+	size_t n = view_nlines();
+	if (G.view.wrapGen == G.view.gen)
+		return;
+
+	size_t *t = G.view.wrap;
+	t[0] = 0;
+	for (size_t i = 1; i <= n; i++)
+		t[i] = view_rows(i - 1);
+	for (size_t i = 1; i <= n; i++) {
+		size_t j = i + (i & -i);
+		if (j <= n)
+			t[j] += t[i];
+	}
+
+	G.view.wrapGen = G.view.gen;
+}
+
+/*
+ *	Carry the rows of uneven lines over to the new snapshot s, only lines
+ *	in its hunks are laid out again. The wrap index is rebuilt from them
+ *	when it's next needed.
+ */
+static void
+rows_remap(const struct snapshot *s)
+{
+	struct rowcache *rows = malloc(sizeof(*rows) * (s->nlines ? s->nlines
+								  : 1));
+	size_t *wrap = malloc(sizeof(size_t) * (s->nlines + 1));
+	fail_if(!rows || !wrap, "failed to lay out the output");
+
+	size_t i = 0;
+	for (size_t h = 0; h <= s->nhunks; h++) {
+		const struct hunk *hk = h < s->nhunks ? &s->hunks[h] : NULL;
+		size_t end = hk ? hk->newStart : s->nlines;
+		size_t j = (hk ? hk->oldStart : G.snap->nlines) - (end - i);
+
+		memcpy(rows + i, G.view.rows + j, sizeof(*rows) * (end - i));
+		i = end;
+
+		for (size_t k = 0; hk && k < hk->newLen; k++, i++)
+			rows[i].gen = G.view.gen - 1;
+	}
+
+	free(G.view.rows);
+	free(G.view.wrap);
+	G.view.rows	= rows;
+	G.view.wrap	= wrap;
+	G.view.wrapGen	= G.view.gen - 1;
+}
+
+/* rows taken by lines before line */
+static size_t
+wrap_row(size_t line)
+{
+	wrap_build();
+
+	size_t row = 0;
+	for (; line; line -= line & -line)
+		row += G.view.wrap[line];
+	return row;
+}
+
+/* position of a row from the beginning of the document */
+static struct pos
+wrap_pos(size_t row)
+{
+	wrap_build();
+
+	size_t n = view_nlines(), line = 0;
+	size_t step = 1;
+	while (step * 2 <= n)
+		step *= 2;
+
+	/* find the last line starting at or before row */
+	for (; step; step /= 2) {
+		if (line + step <= n && G.view.wrap[line + step] <= row) {
+			line += step;
+			row -= G.view.wrap[line];
+		}
+	}
+
+	return (struct pos) { line, row };
+}
+
+static int
+pos_cmp(struct pos a, struct pos b)
+{
+	if (a.line != b.line)
+		return a.line < b.line ? -1 : 1;
+	return a.sub - b.sub;
+}
+
+/* the last position could be at the top, so the screen is still full */
+static struct pos
+pos_max(void)
+{
+	struct pos p = { view_nlines(), 0 };
+	int left = LINES;
+
+	while (p.line > 0 && left > 0) {
+		p.line--;
+		int rows = view_rows(p.line);
+		p.sub = rows > left ? rows - left : 0;
+		left -= rows;
+	}
+
+	return p;
+}
+
+static void
+set_top(struct pos p)
+{
+	struct pos max = pos_max();
+
+	if (pos_cmp(p, max) > 0)
+		p = max;
+	if (p.line < view_nlines() && p.sub >= view_rows(p.line))
+		p.sub = view_rows(p.line) - 1;
+
+	G.view.top = p;
+}
+
+/*
+ *	Move the top of the screen by n rows. Short moves walk only the rows
+ *	passed, long ones are looked up in the wrap index.
+ */
+static void
+scroll_rows(int n)
+{
+	struct pos p = G.view.top;
+
+	if (n > LINES || n < -LINES) {
+		size_t row = wrap_row(p.line) + p.sub;
+		row = n < 0 && (size_t)-n > row ? 0 : row + n;
+		set_top(wrap_pos(row));
+		return;
+	}
+
+	for (; n > 0 && p.line < view_nlines(); n--) {
+		if (++p.sub >= view_rows(p.line)) {
+			p.line++;
+			p.sub = 0;
+		}
+	}
+
+	for (; n < 0 && (p.line || p.sub); n++) {
+		if (--p.sub < 0) {
+			p.line--;
+			p.sub = view_rows(p.line) - 1;
+		}
+	}
+
+	set_top(p);
+}
+
+/* go to line of the snapshot, or the next viewed one */
+static void
+goto_line(size_t line)
+{
+	set_top((struct pos) { view_index(line), 0 });
+}
+
+/* widest line on the screen, from the cached widths */
+static int
+max_width(void)
+{
+	int max = 0, y = 0;
+
+	for (size_t k = G.view.top.line; k < view_nlines() && y < LINES; k++) {
+		const struct line *line = &G.snap->lines[view_line(k)];
+		if (line->width > max)
+			max = line->width;
+		y += view_rows(k);
+	}
+
+	return max;
+}
+
+static void
+set_coloff(int col)
+{
+	int max = G.view.chop ? max_width() - G.view.cols : 0;
+
+	if (col > max)
+		col = max;
+	G.view.coloff = col < 0 ? 0 : col;
+}
+
+static void
+toggle_chop(void)
+{
+	G.view.chop = !G.view.chop;
+	G.view.coloff = 0;
+	G.view.gen++;
+	set_top((struct pos) { G.view.top.line, 0 });
+}
+
+static void
+colidx_free(void)
+{
+	for (int b = 0; b < COLIDX_BUCKETS; b++) {
+		while (G.view.colidx[b]) {
+			struct colidx *next = G.view.colidx[b]->next;
+			free(G.view.colidx[b]);
+			G.view.colidx[b] = next;
+		}
+	}
+}
+
+/*
+ *	Find where to start laying out line i to show it from column col. The
+ *	column index of a line is built the first time it's scrolled past
+ *	COLIDX_STEP and kept until the next reload.
+ */
+static struct colmark
+colidx_find(size_t i, int col)
+{
+	const struct line *line = &G.snap->lines[i];
+	struct colmark start = { line->off, 0 };
+
+	if (line->flags & LINE_PLAIN)
+		return (struct colmark) { line->off + col, col };
+	if (col < COLIDX_STEP)
+		return start;
+
+	struct colidx **head = &G.view.colidx[i % COLIDX_BUCKETS];
+	struct colidx *ci = *head;
+	while (ci && ci->line != i)
+		ci = ci->next;
+
+	if (!ci) {
+		int nmarks = line->width / COLIDX_STEP + 1;
+		ci = malloc(sizeof(*ci) + sizeof(struct colmark) * nmarks);
+		fail_if(!ci, "failed to index the line");
+
+		ci->line	= i;
+		ci->nmarks	= nmarks;
+		ci->next	= *head;
+		*head		= ci;
+
+		struct layout l;
+		struct glyph g;
+		layout_init(&l, G.snap->text + line->off, line->len, INT_MAX);
+
+		struct colmark last = start;
+		int k = 0;
+		while (layout_next(&l, &g)) {
+			while (k < nmarks && k * COLIDX_STEP < g.x)
+				ci->marks[k++] = last;
+			last = (struct colmark) { g.p - G.snap->text, g.x };
+		}
+		while (k < nmarks)
+			ci->marks[k++] = last;
+	}
+
+	int k = col / COLIDX_STEP;
+	return ci->marks[k < ci->nmarks ? k : ci->nmarks - 1];
+}
+
+/*
+ *	Work out the columns left for the text, which change with the width of
+ *	the terminal and of the line numbers.
+ */
+static void
+update_cols(void)
+{
+	int gutter = 0;
+
+	if (G.view.numbers) {
+		gutter = 2;
+		for (size_t n = G.snap->nlines; n >= 10; n /= 10)
+			gutter++;
+		gutter = gutter < COLS / 2 ? gutter : COLS / 2;
+	}
+
+	int cols = COLS - gutter > 1 ? COLS - gutter : 1;
+	if (cols != G.view.cols) {
+		G.view.cols = cols;
+		G.view.gen++;
+	}
+	G.view.gutter = gutter;
+}
+
+static void
+toggle_numbers(void)
+{
+	G.view.numbers = !G.view.numbers;
+	update_cols();
+	set_top(G.view.top);
+}
+
+/* the terminal is resized, ncurses has updated LINES and COLS */
+static void
+handle_resize(void)
+{
+	G.view.gen++;
+	update_cols();
+	set_top(G.view.top);
+}
+
+static void
+show_msg(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(G.view.msg, sizeof(G.view.msg), fmt, ap);
+	va_end(ap);
+}
+
+/*
+ *	Find the first occurrence of pat (m > 0 bytes) in the n bytes at h.
+ *	With SSE2, 16 positions are filtered at a time by both the first and
+ *	the last byte of pat, and only candidates are compared in full.
+ */
+static const char *
+find_str(const char *h, size_t n, const char *pat, size_t m)
+{
+	size_t i = 0;
+
+	if (n < m)
+		return NULL;
+
+#ifdef __SSE2__
+	const __m128i first = _mm_set1_epi8(pat[0]);
+	const __m128i last = _mm_set1_epi8(pat[m - 1]);
+
+	for (; i + m - 1 + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(h + i + m - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+					_mm_cmpeq_epi8(a, first),
+					_mm_cmpeq_epi8(b, last)));
+
+		for (; mask; mask &= mask - 1) {
+			const char *p = h + i + __builtin_ctz(mask);
+			if (!memcmp(p, pat, m))
+				return p;
+		}
+	}
+#endif
+
+	while (i + m <= n) {
+		const char *p = memchr(h + i, pat[0], n - m + 1 - i);
+		if (!p)
+			return NULL;
+		if (!memcmp(p, pat, m))
+			return p;
+		i = p - h + 1;
+	}
+
+	return NULL;
+}
+
+static int
+rx_new(struct regex *re, int op, int out, int out1)
+{
+	if (re->n == re->cap) {
+		re->cap = re->cap ? re->cap * 2 : 64;
+		re->states = realloc(re->states, sizeof(struct nstate) * re->cap);
+		fail_if(!re->states, "failed to compile the pattern");
+	}
+
+	re->states[re->n] = (struct nstate) { .op = op, .out = out,
+					      .out1 = out1 };
+	return re->n++;
+}
+
+/* a piece of NFA, end is an epsilon whose out is yet to be patched */
+struct frag {
+	int start, end;
+};
+
+static struct frag
+rx_op(struct regex *re, int op)
+{
+	int e = rx_new(re, NS_SPLIT, -1, -1);
+	return (struct frag) { rx_new(re, op, e, -1), e };
+}
+
+static struct frag
+rx_set(struct regex *re, const uint32_t set[8])
+{
+	struct frag f = rx_op(re, NS_BYTE);
+	memcpy(re->states[f.start].set, set, sizeof(uint32_t) * 8);
+	return f;
+}
+
+static void
+set_range(uint32_t set[8], unsigned lo, unsigned hi)
+{
+	for (unsigned c = lo; c <= hi; c++)
+		set[c / 32] |= 1u << c % 32;
+}
+
+static struct frag
+rx_byte(struct regex *re, unsigned char c)
+{
+	uint32_t set[8] = { 0 };
+	set_range(set, c, c);
+	return rx_set(re, set);
+}
+
+static struct frag
+rx_cat(struct regex *re, struct frag a, struct frag b)
+{
+	re->states[a.end].out = b.start;
+	return (struct frag) { a.start, b.end };
+}
+
+static struct frag
+rx_alt(struct regex *re, struct frag a, struct frag b)
+{
+	int e = rx_new(re, NS_SPLIT, -1, -1);
+	re->states[a.end].out = e;
+	re->states[b.end].out = e;
+	return (struct frag) { rx_new(re, NS_SPLIT, a.start, b.start), e };
+}
+
+/* op is one of '*', '+' and '?' */
+static struct frag
+rx_repeat(struct regex *re, struct frag a, int op)
+{
+	int e = rx_new(re, NS_SPLIT, -1, -1);
+	int s = rx_new(re, NS_SPLIT, a.start, e);
+
+	re->states[a.end].out = op == '?' ? e : s;
+	return (struct frag) { op == '+' ? a.start : s, e };
+}
+
+/* a UTF-8 character, ASCII ones only if they're in ascii */
+static struct frag
+rx_any(struct regex *re, const uint32_t ascii[8])
+{
+	static const unsigned char lead[3][2] = {
+		{ 0xc0, 0xdf }, { 0xe0, 0xef }, { 0xf0, 0xf7 },
+	};
+	uint32_t cont[8] = { 0 };
+	set_range(cont, 0x80, 0xbf);
+
+	struct frag f = rx_set(re, ascii);
+	for (int k = 0; k < 3; k++) {
+		uint32_t set[8] = { 0 };
+		set_range(set, lead[k][0], lead[k][1]);
+
+		struct frag g = rx_set(re, set);
+		for (int j = 0; j <= k; j++)
+			g = rx_cat(re, g, rx_set(re, cont));
+		f = rx_alt(re, f, g);
+	}
+
+	return f;
+}
+
+struct rx_parser {
+	struct regex *re;
+	const unsigned char *p, *end;
+	const char *err;
+};
+
+static struct frag rx_parse_alt(struct rx_parser *ps);
+
+static struct frag
+rx_parse_class(struct rx_parser *ps)
+{
+	uint32_t set[8] = { 0 };
+	int neg = 0;
+
+	ps->p++;
+	if (ps->p < ps->end && *ps->p == '^') {
+		neg = 1;
+		ps->p++;
+	}
+
+	for (int first = 1; ps->p < ps->end && (*ps->p != ']' || first);
+	     first = 0) {
+		unsigned lo = *ps->p++, hi;
+
+		if (lo == '\\' && ps->p < ps->end)
+			lo = *ps->p++;
+		hi = lo;
+
+		if (ps->end - ps->p >= 2 && *ps->p == '-' && ps->p[1] != ']') {
+			hi = ps->p[1];
+			ps->p += 2;
+		}
+
+		if (lo >= 0x80 || hi >= 0x80) {
+			ps->err = "only ASCII characters are allowed in []";
+			break;
+		} else if (hi < lo) {
+			ps->err = "invalid range in []";
+			break;
+		}
+		set_range(set, lo, hi);
+	}
+
+	if (ps->p >= ps->end && !ps->err)
+		ps->err = "missing ]";
+	ps->p++;
+
+	if (!neg)
+		return rx_set(ps->re, set);
+
+	for (int k = 0; k < 4; k++)
+		set[k] = ~set[k];
+	return rx_any(ps->re, set);
+}
+
+static struct frag
+rx_parse_atom(struct rx_parser *ps)
+{
+	struct regex *re = ps->re;
+	unsigned char c = *ps->p;
+	struct frag f;
+
+	switch (c) {
+	case '(':
+		ps->p++;
+		f = rx_parse_alt(ps);
+		if (ps->p >= ps->end || *ps->p != ')')
+			ps->err = "missing )";
+		ps->p++;
+		return f;
+	case '[':
+		return rx_parse_class(ps);
+	case '.': {
+		uint32_t ascii[8] = { 0 };
+		set_range(ascii, 0, 0x7f);
+		ps->p++;
+		return rx_any(re, ascii);
+	}
+	case '^':
+		ps->p++;
+		return rx_op(re, NS_BOL);
+	case '$':
+		ps->p++;
+		return rx_op(re, NS_EOL);
+	case '*':
+	case '+':
+	case '?':
+		ps->err = "nothing to repeat";
+		ps->p++;
+		return rx_op(re, NS_SPLIT);
+	case '\\':
+		if (++ps->p >= ps->end) {
+			ps->err = "trailing \\";
+			return rx_op(re, NS_SPLIT);
+		}
+		break;
+	}
+
+	/* a literal, multibyte characters are repeated as a whole */
+	f = rx_byte(re, *ps->p++);
+	while (ps->p < ps->end && (*ps->p & 0xc0) == 0x80)
+		f = rx_cat(re, f, rx_byte(re, *ps->p++));
+	return f;
+}
+
+static struct frag
+rx_parse_cat(struct rx_parser *ps)
+{
+	struct frag f = rx_op(ps->re, NS_SPLIT);
+
+	while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')' && !ps->err) {
+		struct frag a = rx_parse_atom(ps);
+
+		while (ps->p < ps->end && strchr("*+?", *ps->p) && *ps->p)
+			a = rx_repeat(ps->re, a, *ps->p++);
+		f = rx_cat(ps->re, f, a);
+	}
+
+	return f;
+}
+
+static struct frag
+rx_parse_alt(struct rx_parser *ps)
+{
+	struct frag f = rx_parse_cat(ps);
+
+	while (ps->p < ps->end && *ps->p == '|' && !ps->err) {
+		ps->p++;
+		f = rx_alt(ps->re, f, rx_parse_cat(ps));
+	}
+
+	return f;
+}
+
+enum {
+	AT_BOL = 1 << 0,
+	AT_EOL = 1 << 1,
+};
+
+/* add NFA states reachable from s through epsilons to the set */
+static void
+rx_closure(struct regex *re, int s, unsigned at)
+{
+	int top = 0;
+	re->stack[top++] = s;
+
+	while (top) {
+		s = re->stack[--top];
+		if (s < 0 || re->mark[s] == re->gen)
+			continue;
+		re->mark[s] = re->gen;
+
+		const struct nstate *ns = &re->states[s];
+		switch (ns->op) {
+		case NS_SPLIT:
+			re->stack[top++] = ns->out;
+			re->stack[top++] = ns->out1;
+			break;
+		case NS_BOL:
+			if (at & AT_BOL)
+				re->stack[top++] = ns->out;
+			break;
+		case NS_EOL:
+			if (at & AT_EOL)
+				re->stack[top++] = ns->out;
+			else
+				re->set[re->nset++] = s;
+			break;
+		default:
+			re->set[re->nset++] = s;
+			break;
+		}
+	}
+}
+
+static void
+rx_set_begin(struct regex *re)
+{
+	re->gen++;
+	re->nset = 0;
+}
+
+static int
+int_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* find or create the DFA state of the set just built */
+static struct dstate *
+dfa_intern(struct regex *re, struct dfa *d)
+{
+	qsort(re->set, re->nset, sizeof(int), int_cmp);
+
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int k = 0; k < re->nset; k++)
+		h = (h ^ re->set[k]) * 0x100000001b3ULL;
+
+	struct dstate **head = &d->buckets[h % DFA_BUCKETS];
+	for (struct dstate *ds = *head; ds; ds = ds->hnext) {
+		if (ds->n == re->nset &&
+		    !memcmp(ds->states, re->set, sizeof(int) * re->nset))
+			return ds;
+	}
+
+	struct dstate *ds = calloc(1, sizeof(*ds) + sizeof(int) * re->nset);
+	fail_if(!ds, "failed to search");
+
+	ds->n = re->nset;
+	ds->eolMatch = -1;
+	memcpy(ds->states, re->set, sizeof(int) * re->nset);
+	for (int k = 0; k < ds->n; k++)
+		ds->match |= re->states[ds->states[k]].op == NS_MATCH;
+
+	ds->hnext = *head;
+	*head = ds;
+	d->nstates++;
+
+	return ds;
+}
+
+static void
+dfa_flush(struct regex *re, struct dfa *d)
+{
+	for (int b = 0; b < DFA_BUCKETS; b++) {
+		while (d->buckets[b]) {
+			struct dstate *ds = d->buckets[b];
+			d->buckets[b] = ds->hnext;
+			free(ds);
+		}
+	}
+	d->nstates = 0;
+
+	if (!re)
+		return;
+
+	for (int bol = 0; bol < 2; bol++) {
+		rx_set_begin(re);
+		rx_closure(re, re->start, bol ? AT_BOL : 0);
+		d->start[bol] = dfa_intern(re, d);
+	}
+}
+
+static struct dstate *
+dfa_next(struct regex *re, struct dfa *d, struct dstate *ds, unsigned char c)
+{
+	if (ds->next[c])
+		return ds->next[c];
+
+	rx_set_begin(re);
+	for (int k = 0; k < ds->n; k++) {
+		const struct nstate *ns = &re->states[ds->states[k]];
+		if (ns->op == NS_BYTE && ns->set[c / 32] & 1u << c % 32)
+			rx_closure(re, ns->out, 0);
+	}
+
+	/* a match may start at any position */
+	if (!d->anchored)
+		rx_closure(re, re->start, 0);
+
+	return ds->next[c] = dfa_intern(re, d);
+}
+
+static int
+dfa_eol(struct regex *re, struct dstate *ds)
+{
+	if (ds->eolMatch < 0) {
+		rx_set_begin(re);
+		for (int k = 0; k < ds->n; k++) {
+			const struct nstate *ns = &re->states[ds->states[k]];
+			if (ns->op == NS_EOL)
+				rx_closure(re, ns->out, AT_EOL);
+		}
+
+		ds->eolMatch = 0;
+		for (int k = 0; k < re->nset; k++)
+			ds->eolMatch |= re->states[re->set[k]].op == NS_MATCH;
+	}
+
+	return ds->eolMatch;
+}
+
+/* states are only freed between lines, never while one is matched */
+static void
+dfa_check(struct regex *re, struct dfa *d)
+{
+	if (d->nstates > DFA_MAX_STATES)
+		dfa_flush(re, d);
+}
+
+static void
+rx_free(struct regex *re)
+{
+	if (!re)
+		return;
+
+	dfa_flush(NULL, &re->search);
+	dfa_flush(NULL, &re->longest);
+	free(re->states);
+	free(re->set);
+	free(re->stack);
+	free(re->mark);
+	free(re);
+}
+
+static struct regex *
+rx_compile(const char *pat, size_t len, const char **err)
+{
+	struct regex *re = calloc(1, sizeof(*re));
+	fail_if(!re, "failed to compile the pattern");
+
+	struct rx_parser ps = {
+		.re	= re,
+		.p	= (const unsigned char *)pat,
+		.end	= (const unsigned char *)pat + len,
+	};
+	struct frag f = rx_parse_alt(&ps);
+
+	if (!ps.err && ps.p < ps.end)
+		ps.err = "unmatched )";
+	if (ps.err) {
+		*err = ps.err;
+		rx_free(re);
+		return NULL;
+	}
+
+	re->start = f.start;
+	re->states[f.end].out = rx_new(re, NS_MATCH, -1, -1);
+
+	re->set		= malloc(sizeof(int) * re->n);
+	re->stack	= malloc(sizeof(int) * (re->n * 2 + 1));
+	re->mark	= calloc(re->n, sizeof(unsigned));
+	fail_if(!re->set || !re->stack || !re->mark,
+		"failed to compile the pattern");
+
+	re->longest.anchored = 1;
+	dfa_flush(re, &re->search);
+	dfa_flush(re, &re->longest);
+
+	return re;
+}
+
+static int
+rx_match(struct regex *re, const char *p, size_t len)
+{
+	dfa_check(re, &re->search);
+
+	struct dstate *ds = re->search.start[1];
+	for (size_t i = 0; i < len && !ds->match; i++)
+		ds = dfa_next(re, &re->search, ds, p[i]);
+
+	return ds->match || dfa_eol(re, ds);
+}
+
+/* end of the longest match starting at byte i, SIZE_MAX if none */
+static size_t
+rx_longest(struct regex *re, const char *p, size_t len, size_t i)
+{
+	dfa_check(re, &re->longest);
+
+	struct dstate *ds = re->longest.start[i == 0];
+	size_t end = ds->match ? i : SIZE_MAX;
+
+	for (; i < len && ds->n; i++) {
+		ds = dfa_next(re, &re->longest, ds, p[i]);
+		if (ds->match)
+			end = i + 1;
+	}
+
+	if (i == len && dfa_eol(re, ds))
+		end = len;
+	return end;
+}
+
+/*
+ *	Patterns without metacharacters are matched literally, others are
+ *	compiled to regexes. Returns -1 and stores why to *err if str is
+ *	invalid.
+ */
+static int
+pattern_set(struct pattern *pt, const char *str, size_t len, const char **err)
+{
+	struct regex *re = NULL;
+
+	if (strcspn(str, "\\.[]()*+?|^$") < len) {
+		re = rx_compile(str, len, err);
+		if (!re)
+			return -1;
+	}
+
+	rx_free(pt->re);
+	pt->re = re;
+	memcpy(pt->str, str, len);
+	pt->str[len] = '\0';
+	pt->len = len;
+
+	return 0;
+}
+
+static void
+pattern_clear(struct pattern *pt)
+{
+	rx_free(pt->re);
+	pt->re = NULL;
+	pt->len = 0;
+}
+
+static int
+pattern_match(const struct pattern *pt, const char *p, size_t len)
+{
+	if (pt->re)
+		return rx_match(pt->re, p, len);
+	return find_str(p, len, pt->str, pt->len) != NULL;
+}
+
+/*
+ *	Find the leftmost match in the len bytes at p, from byte from on. The
+ *	longest one is taken for a regex. Returns the start of it and stores
+ *	the end to *end, or returns SIZE_MAX if there's none.
+ */
+static size_t
+pattern_find(const struct pattern *pt, const char *p, size_t len, size_t from,
+	     size_t *end)
+{
+	if (!pt->re) {
+		const char *q = find_str(p + from, len - from, pt->str,
+					 pt->len);
+		*end = q ? q - p + pt->len : 0;
+		return q ? (size_t)(q - p) : SIZE_MAX;
+	}
+
+	for (size_t i = from; i <= len; i++) {
+		if (i < len && (p[i] & 0xc0) == 0x80)
+			continue;
+
+		*end = rx_longest(pt->re, p, len, i);
+		if (*end != SIZE_MAX)
+			return i;
+	}
+
+	return SIZE_MAX;
+}
+
+/* whether line i matches, searching it if it's not known yet */
+static int
+search_line(size_t i)
+{
+	unsigned char *st = &G.search.state[i];
+
+	if (*st == SEARCH_UNKNOWN) {
+		const struct line *line = &G.snap->lines[i];
+		int hit = pattern_match(&G.search.pat,
+					G.snap->text + line->off, line->len);
+
+		*st = hit ? SEARCH_HIT : SEARCH_MISS;
+		G.search.unknown--;
+		G.search.nmatches += hit;
+	}
+
+	return *st == SEARCH_HIT;
+}
+
+/*
+ *	Search about SEARCH_CHUNK bytes of lines that aren't known yet, going
+ *	both down and up from the viewport, so nearby matches are known first.
+ *	It's called whenever the UI is idle until every line is known.
+ */
+static void
+search_step(void)
+{
+	for (size_t n = 0; n < SEARCH_CHUNK && G.search.unknown;) {
+		if (G.search.down < G.snap->nlines) {
+			n += G.snap->lines[G.search.down].len + 16;
+			search_line(G.search.down++);
+		}
+		if (G.search.up > 0) {
+			n += G.snap->lines[G.search.up - 1].len + 16;
+			search_line(--G.search.up);
+		}
+	}
+}
+
+static int
+search_start(const char *pat, size_t len, int backward)
+{
+	size_t n = G.snap->nlines;
+	const char *err;
+
+	if (pattern_set(&G.search.pat, pat, len, &err)) {
+		show_msg("Invalid pattern: %s", err);
+		return -1;
+	}
+
+	free(G.search.state);
+	G.search.state = calloc(n ? n : 1, 1);
+	fail_if(!G.search.state, "failed to search");
+
+	G.search.backward	= backward;
+	G.search.unknown	= n;
+	G.search.nmatches	= 0;
+	G.search.up		= top_line();
+	G.search.down		= top_line();
+	G.search.last		= SIZE_MAX;
+
+	return 0;
+}
+
+static int
+filter_has(size_t i)
+{
+	size_t k = view_index(i);
+	return k < G.filter.n && G.filter.lines[k] == i;
+}
+
+/*
+ *	Go to the next match in the given direction, among viewed lines. It's
+ *	searched from the last match if it's still on the screen, since the
+ *	last lines could never get to the top.
+ */
+static void
+search_next(int backward)
+{
+	size_t i = top_line();
+
+	if (!G.search.pat.len) {
+		show_msg("No previous search");
+		return;
+	}
+
+	if (G.search.last != SIZE_MAX && G.search.last > i &&
+	    view_index(G.search.last) < G.view.top.line + LINES)
+		i = G.search.last;
+
+	while (backward ? i-- > 0 : ++i < G.snap->nlines) {
+		if (G.filter.pat.len && !filter_has(i))
+			continue;
+		if (search_line(i)) {
+			G.search.last = i;
+			goto_line(i);
+			return;
+		}
+	}
+
+	show_msg("Pattern not found: %s", G.search.pat.str);
+}
+
+/*
+ *	Carry the search over to the new snapshot s, lines out of its hunks
+ *	keep what's known about them, only changed ones are searched again.
+ */
+static void
+search_remap(const struct snapshot *s)
+{
+	if (!G.search.pat.len)
+		return;
+
+	unsigned char *state = malloc(s->nlines ? s->nlines : 1);
+	fail_if(!state, "failed to search");
+
+	size_t i = 0, unknown = 0, nmatches = 0;
+	for (size_t h = 0; h <= s->nhunks; h++) {
+		const struct hunk *hk = h < s->nhunks ? &s->hunks[h] : NULL;
+		size_t end = hk ? hk->newStart : s->nlines;
+		size_t j = (hk ? hk->oldStart : G.snap->nlines) - (end - i);
+
+		for (; i < end; i++, j++) {
+			state[i] = G.search.state[j];
+			unknown += state[i] == SEARCH_UNKNOWN;
+			nmatches += state[i] == SEARCH_HIT;
+		}
+
+		if (hk) {
+			memset(state + i, SEARCH_UNKNOWN, hk->newLen);
+			i += hk->newLen;
+			unknown += hk->newLen;
+		}
+	}
+
+	free(G.search.state);
+	G.search.state		= state;
+	G.search.unknown	= unknown;
+	G.search.nmatches	= nmatches;
+	G.search.last		= SIZE_MAX;
+}
+
+/*
+ *	View only lines matching pat, or every line if len is 0. The top line
+ *	stays, or the next matching one does.
+ */
+static int
+filter_start(const char *pat, size_t len)
+{
+	size_t top = top_line();
+	const char *err;
+
+	if (!len) {
+		pattern_clear(&G.filter.pat);
+	} else {
+		if (pattern_set(&G.filter.pat, pat, len, &err)) {
+			show_msg("Invalid pattern: %s", err);
+			return -1;
+		}
+
+		size_t n = 0;
+		G.filter.lines = realloc(G.filter.lines,
+					 sizeof(size_t) * (G.snap->nlines + 1));
+		fail_if(!G.filter.lines, "failed to filter");
+
+		for (size_t i = 0; i < G.snap->nlines; i++) {
+			const struct line *line = &G.snap->lines[i];
+			if (pattern_match(&G.filter.pat,
+					  G.snap->text + line->off, line->len))
+				G.filter.lines[n++] = i;
+		}
+		G.filter.n = n;
+	}
+
+	G.view.gen++;
+	goto_line(top);
+	return 0;
+}
+
+/*
+ *	Carry the filter over to the new snapshot s. Matching lines out of its
+ *	hunks are only renumbered, and only lines in hunks are matched.
+ */
+static void
+filter_remap(const struct snapshot *s)
+{
+	if (!G.filter.pat.len)
+		return;
+
+	size_t cap = G.filter.n + 1;
+	for (size_t h = 0; h < s->nhunks; h++)
+		cap += s->hunks[h].newLen;
+
+	size_t *lines = malloc(sizeof(size_t) * cap);
+	fail_if(!lines, "failed to filter");
+
+	size_t k = 0, n = 0;
+	for (size_t h = 0; h <= s->nhunks; h++) {
+		const struct hunk *hk = h < s->nhunks ? &s->hunks[h] : NULL;
+		size_t oldEnd = hk ? hk->oldStart : G.snap->nlines;
+		size_t newEnd = hk ? hk->newStart : s->nlines;
+
+		for (; k < G.filter.n && G.filter.lines[k] < oldEnd; k++)
+			lines[n++] = G.filter.lines[k] - oldEnd + newEnd;
+
+		if (!hk)
+			break;
+
+		while (k < G.filter.n &&
+		       G.filter.lines[k] < hk->oldStart + hk->oldLen)
+			k++;
+
+		for (size_t i = hk->newStart; i < newEnd + hk->newLen; i++) {
+			const struct line *line = &s->lines[i];
+			if (pattern_match(&G.filter.pat, s->text + line->off,
+					  line->len))
+				lines[n++] = i;
+		}
+	}
+
+	free(G.filter.lines);
+	G.filter.lines	= lines;
+	G.filter.n	= n;
+}
+
+/* index of the last heading at or before line i, SIZE_MAX if none */
+static size_t
+outline_find(size_t i)
+{
+	size_t lo = 0, hi = G.snap->nheads;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (G.snap->heads[mid] <= i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? lo - 1 : SIZE_MAX;
+}
+
+/* go to the next heading after the top line, or the previous one before */
+static void
+outline_next(int backward)
+{
+	size_t k = outline_find(top_line());
+
+	if (backward && k != SIZE_MAX && G.snap->heads[k] == top_line())
+		k--;
+	else if (!backward)
+		k++;
+
+	if (k >= G.snap->nheads) {
+		show_msg("No more sections");
+		return;
+	}
+	goto_line(G.snap->heads[k]);
+}
+
+/* go to the next heading containing name, wrapping around */
+static void
+outline_goto(const char *name, size_t len)
+{
+	size_t n = G.snap->nheads, k = outline_find(top_line());
+
+	for (size_t t = 1; t <= n; t++) {
+		size_t h = G.snap->heads[(k + t) % n];
+		const struct line *line = &G.snap->lines[h];
+
+		if (find_str(G.snap->text + line->off, line->len, name, len)) {
+			goto_line(h);
+			return;
+		}
+	}
+
+	show_msg("No section: %.*s", (int)len, name);
+}
+
+static void
+outline_toggle(void)
+{
+	size_t k = outline_find(top_line());
+
+	G.outline.shown = !G.outline.shown;
+	G.outline.sel = k == SIZE_MAX ? 0 : k;
+}
+
+/*
+ *	Where line of the old snapshot is in s, which is diffed against it.
+ *	Lines out of hunks are shifted by the last hunk before them, found by
+ *	binary search, and a changed line is looked for by its hash in the hunk
+ *	replacing it.
+ */
+static size_t
+line_remap(const struct snapshot *s, size_t line, uint64_t hash)
+{
+	size_t lo = 0, hi = s->nhunks;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (s->hunks[mid].oldStart <= line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		return line;
+
+	const struct hunk *hk = &s->hunks[lo - 1];
+	if (line >= hk->oldStart + hk->oldLen)
+		return line - hk->oldStart - hk->oldLen +
+		       hk->newStart + hk->newLen;
+
+	for (size_t i = hk->newStart; i < hk->newStart + hk->newLen; i++) {
+		if (s->lines[i].hash == hash)
+			return i;
+	}
+
+	size_t off = line - hk->oldStart;
+	return hk->newStart + (off < hk->newLen ? off : hk->newLen);
+}
+
+static void
+marks_remap(const struct snapshot *s)
+{
+	for (int k = 0; k < 27; k++) {
+		struct mark *m = &G.marks[k];
+		if (!m->set)
+			continue;
+
+		m->line = line_remap(s, m->line, m->hash);
+		if (m->line >= s->nlines)
+			m->line = s->nlines ? s->nlines - 1 : 0;
+		m->hash = s->nlines ? s->lines[m->line].hash : 0;
+	}
+}
+
+static void
+mark_set(int k, size_t line)
+{
+	G.marks[k] = (struct mark) {
+		.set	= 1,
+		.line	= line,
+		.hash	= line < G.snap->nlines ? G.snap->lines[line].hash : 0,
+	};
+}
+
+/* 'a to 'z go to a mark, '' goes back to where the last one was gone to */
+static void
+mark_goto(int k)
+{
+	struct mark m = G.marks[k];
+
+	if (!m.set) {
+		show_msg("Mark not set");
+		return;
+	}
+
+	mark_set(26, top_line());
+	goto_line(m.line);
+}
+
+static void
+snapshot_retire(struct snapshot *s)
+{
+	s->next = atomic_load(&G.retired);
+	while (!atomic_compare_exchange_weak(&G.retired, &s->next, s))
+		;
+}
+
+/*
+ *	Take diagnostics published by the worker, if any. Never blocks. Errors
+ *	of a failed render are shown at once, others only when asked for.
+ */
+static void
+diag_take(void)
+{
+	struct diag *d = atomic_exchange(&G.pendingDiag, NULL);
+	if (!d)
+		return;
+
+	if (diag_failed(d))
+		G.diag.shown = 1;
+	else if (G.diag.d && diag_failed(G.diag.d))
+		G.diag.shown = 0;
+
+	diag_free(G.diag.d);
+	G.diag.d = d;
+}
+
+/*
+ *	Switch to the snapshot published by the worker, if any. Never blocks.
+ */
+static void
+do_reload(void)
+{
+	struct snapshot *s = atomic_exchange(&G.pending, NULL);
+	if (!s)
+		return;
+
+	colidx_free();
+	rows_remap(s);
+
+	search_remap(s);
+	filter_remap(s);
+	marks_remap(s);
+	snapshot_retire(G.snap);
+	G.snap = s;
+
+	if (G.outline.sel >= s->nheads)
+		G.outline.sel = s->nheads ? s->nheads - 1 : 0;
+	update_cols();
+
+	/* move the focus to the changed part */
+	if (s->changed == SIZE_MAX)
+		set_top(G.view.top);
+	else
+		goto_line(s->changed);
+
+	G.search.up = G.search.down = top_line();
+}
+
+/*
+ *	Changes during a render are coalesced into one more render after it
+ *	finishes.
+ */
+static void
+request_reload(void)
+{
+	if (G.render.pid)
+		G.render.pending = 1;
+	else
+		render_start();
+}
+
+static uint64_t
+dep_hash(int wd, const char *name)
+{
+	return hash_line(name, strlen(name)) ^ (uint64_t)wd * 0x9e3779b97f4a7c15ULL;
+}
+
+static struct dep *
+dep_find(int wd, const char *name)
+{
+	struct dep *d = G.worker.deps[dep_hash(wd, name) % DEP_BUCKETS];
+
+	while (d && (d->wd != wd || strcmp(d->name, name)))
+		d = d->next;
+	return d;
+}
+
+static struct watchdir *
+watchdir_find(int wd)
+{
+	struct watchdir *w = G.worker.dirs[wd % WATCH_BUCKETS];
+
+	while (w && w->wd != wd)
+		w = w->next;
+	return w;
+}
+
+static struct watchdir *
+watchdir_add(int wd, const char *path)
+{
+	struct watchdir *w = watchdir_find(wd);
+	if (w)
+		return w;
+
+	w = malloc(sizeof(*w) + strlen(path) + 1);
+	if (!w)
+		return NULL;
+
+	struct watchdir **wh = &G.worker.dirs[wd % WATCH_BUCKETS];
+	w->wd	= wd;
+	w->tree	= 0;
+	strcpy(w->path, path);
+	w->next	= *wh;
+	*wh	= w;
+
+	return w;
+}
+
+static void
+watchdir_remove(int wd)
+{
+	struct watchdir **wh = &G.worker.dirs[wd % WATCH_BUCKETS];
+
+	while (*wh && (*wh)->wd != wd)
+		wh = &(*wh)->next;
+
+	if (*wh) {
+		struct watchdir *w = *wh;
+		*wh = w->next;
+		free(w);
+		G.poll.dirty = 1;
+	}
+}
+
+/*
+ *	Watch the tree under root, directories already watched are walked
+ *	again but not added twice. d_type tells directories apart without a
+ *	stat for every entry, so walking is a few syscalls per directory
+ *	however many files there are. Hidden ones are skipped, they are
+ *	rarely sources but often written to, like .git.
+ */
+/* stop watching the directory at path and everything under it */
+static void
+tree_remove(const char *path)
+{
+	size_t len = strlen(path);
+
+	for (int i = 0; i < WATCH_BUCKETS; i++) {
+		struct watchdir **wh = &G.worker.dirs[i];
+		while (*wh) {
+			struct watchdir *w = *wh;
+			if (!w->tree || strncmp(w->path, path, len) ||
+			    (w->path[len] && w->path[len] != '/')) {
+				wh = &w->next;
+				continue;
+			}
+
+			inotify_rm_watch(G.worker.watchfd, w->wd);
+			*wh = w->next;
+			free(w);
+			G.poll.dirty = 1;
+		}
+	}
+}
+
+static int
+tree_add(const char *root)
+{
+	size_t n = 0, cap = 64;
+	char **stack = malloc(cap * sizeof(char *));
+	char *first = strdup(root);
+	if (!stack || !first) {
+		free(stack);
+		free(first);
+		return -1;
+	}
+	stack[n++] = first;
+
+	int ret = 0;
+	while (n) {
+		char *path = stack[--n];
+
+		int wd = inotify_add_watch(G.worker.watchfd, path,
+					   TREE_EVENTS | IN_ONLYDIR |
+					   IN_MASK_ADD);
+		struct watchdir *w = wd < 0 ? NULL : watchdir_add(wd, path);
+		int fd = w ? open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+			   : -1;
+		DIR *d = fd < 0 ? NULL : fdopendir(fd);
+
+		if (!d) {
+			/* removed before we got to it */
+			if (errno != ENOENT && errno != ENOTDIR)
+				ret = -1;
+			if (fd >= 0)
+				close(fd);
+			free(path);
+			continue;
+		}
+		if (!w->tree) {
+			w->tree = 1;
+			G.poll.dirty = 1;
+		}
+
+		struct dirent *e;
+		while ((e = readdir(d))) {
+			if (e->d_name[0] == '.')
+				continue;
+
+			int isdir = e->d_type == DT_DIR;
+			if (e->d_type == DT_UNKNOWN) {
+				struct stat st;
+				isdir = !fstatat(fd, e->d_name, &st,
+						 AT_SYMLINK_NOFOLLOW) &&
+					S_ISDIR(st.st_mode);
+			}
+			if (!isdir)
+				continue;
+
+			if (n == cap) {
+				char **p = realloc(stack,
+						   cap * 2 * sizeof(char *));
+				if (!p) {
+					ret = -1;
+					break;
+				}
+				stack = p;
+				cap *= 2;
+			}
+
+			size_t len = strlen(path);
+			char *sub = malloc(len + strlen(e->d_name) + 2);
+			if (!sub) {
+				ret = -1;
+				break;
+			}
+
+			sprintf(sub, "%s%s%s", path,
+				len && path[len - 1] == '/' ? "" : "/",
+				e->d_name);
+			stack[n++] = sub;
+		}
+
+		closedir(d);
+		free(path);
+	}
+
+	free(stack);
+	return ret;
+}
+
+/*
+ *	Put the render off until the burst of changes settles, each change
+ *	pushes the deadline further unless the burst has gone on for too long.
+ */
+static void
+reload_settled(void)
+{
+	long long now = now_ns();
+
+	if (!G.worker.burst)
+		G.worker.burst = now;
+	else if (now + SETTLE_NS > G.worker.burst + SETTLE_MAX_NS)
+		return;
+
+	struct itimerspec its = {
+		.it_value = { .tv_nsec = SETTLE_NS },
+	};
+	timerfd_settime(G.worker.settlefd, 0, &its, NULL);
+}
+
+/*
+ *	The watched files have changed, from inotify or polling. Writes to the
+ *	file are rendered ahead while it's still open, if nothing else changes
+ *	until it's closed the render is right and shown.
+ */
+static void
+source_changed(int how)
+{
+	if (G.worker.treewd >= 0) {
+		reload_settled();
+		return;
+	}
+
+	/* what is being rendered is out of date */
+	if (how & CHANGE_MODIFY)
+		render_cancel();
+
+	if (how == CHANGE_MODIFY) {
+		struct itimerspec its = {
+			.it_value = { .tv_nsec = SPEC_SETTLE_NS },
+		};
+		timerfd_settime(G.worker.settlefd, 0, &its, NULL);
+
+		G.render.spec = 1;
+		request_reload();
+		return;
+	}
+
+	if (how == CHANGE_WRITTEN && G.render.spec) {
+		render_commit();
+		return;
+	}
+
+	/* the speculative render may have read the half-written file */
+	if (G.render.spec)
+		render_cancel();
+
+	G.render.spec = 0;
+	G.render.held = 0;
+	request_reload();
+}
+
+/*
+ *	Watch path as a dependency, through its directory. The watch is added
+ *	to that of the file itself if it's in the same directory. gen is that
+ *	of the render opening it, or 0 for ones given by the user.
+ */
+static struct dep *
+dep_add(const char *path, unsigned gen)
+{
+	const char *slash = strrchr(path, '/');
+	const char *name = slash ? slash + 1 : path;
+	char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+	if (!dir)
+		return NULL;
+
+	int wd = inotify_add_watch(G.worker.watchfd, dir,
+				   DEP_EVENTS | IN_MASK_ADD);
+	if (wd < 0) {
+		free(dir);
+		return NULL;
+	}
+
+	struct watchdir *w = watchdir_add(wd, dir);
+	free(dir);
+	if (!w)
+		return NULL;
+
+	struct dep *d = dep_find(wd, name);
+	if (d) {
+		if (d->gen)
+			d->gen = gen;
+		return d;
+	}
+
+	d = malloc(sizeof(*d) + strlen(name) + 1);
+	if (!d)
+		return NULL;
+
+	struct dep **dh = &G.worker.deps[dep_hash(wd, name) % DEP_BUCKETS];
+	d->wd  = wd;
+	d->gen = gen;
+	strcpy(d->name, name);
+	d->next = *dh;
+	*dh = d;
+	G.poll.dirty = 1;
+
+	return d;
+}
+
+/*
+ *	A file opened by the render, seen ones are only marked as opened by
+ *	this render without touching the watches again.
+ */
+static void
+trace_report(const char *path, size_t len)
+{
+	struct tracedpath **th = &G.trace.paths[hash_line(path, len) %
+						TRACE_BUCKETS];
+	struct tracedpath *t = *th;
+	while (t && strcmp(t->path, path))
+		t = t->next;
+
+	if (t) {
+		t->gen = G.trace.gen;
+		if (t->dep->gen)
+			t->dep->gen = G.trace.gen;
+		return;
+	}
+
+	/* unwatchable files are reported again, but rarely */
+	struct dep *d = dep_add(path, G.trace.gen);
+	if (!d)
+		return;
+
+	t = malloc(sizeof(*t) + len + 1);
+	if (!t)
+		return;
+
+	t->dep = d;
+	t->gen = G.trace.gen;
+	memcpy(t->path, path, len + 1);
+	t->next = *th;
+	*th = t;
+}
+
+/*
+ *	Reports come as lines of absolute paths. Lines never exceed PIPE_BUF,
+ *	longer ones aren't from the shim and are skipped.
+ */
+static void
+trace_read(const char *p, size_t len)
+{
+	const char *end = p + len;
+
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		size_t n = (eol ? eol : end) - p;
+
+		if (G.trace.len != SIZE_MAX &&
+		    G.trace.len + n < sizeof(G.trace.line)) {
+			memcpy(G.trace.line + G.trace.len, p, n);
+			G.trace.len += n;
+		} else {
+			G.trace.len = SIZE_MAX;
+		}
+
+		if (!eol)
+			break;
+
+		if (G.trace.len != SIZE_MAX && G.trace.len) {
+			G.trace.line[G.trace.len] = '\0';
+			trace_report(G.trace.line, G.trace.len);
+		}
+		G.trace.len = 0;
+		p = eol + 1;
+	}
+}
+
+/*
+ *	All opens of the render are known, stop watching files it has opened
+ *	before but not this time, so only files affecting the output trigger
+ *	renders. Watches of their directories are kept, events of files not
+ *	depended on are simply ignored.
+ */
+static void
+trace_finish(void)
+{
+	close(G.trace.fd);
+	G.trace.fd = -1;
+
+	/* a killed render hasn't opened everything */
+	if (G.render.cancelled || G.render.breach[0])
+		return;
+
+	for (int i = 0; i < TRACE_BUCKETS; i++) {
+		struct tracedpath **th = &G.trace.paths[i];
+		while (*th) {
+			struct tracedpath *t = *th;
+			if (t->gen == G.trace.gen) {
+				th = &t->next;
+			} else {
+				*th = t->next;
+				free(t);
+			}
+		}
+	}
+
+	for (int i = 0; i < DEP_BUCKETS; i++) {
+		struct dep **dh = &G.worker.deps[i];
+		while (*dh) {
+			struct dep *d = *dh;
+			if (!d->gen || d->gen == G.trace.gen) {
+				dh = &d->next;
+			} else {
+				*dh = d->next;
+				free(d);
+				G.poll.dirty = 1;
+			}
+		}
+	}
+}
+
+static int
+pollfile_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct pollfile *)a)->path,
+		      ((const struct pollfile *)b)->path);
+}
+
+static int
+poll_push(struct pollfile **files, size_t *n, size_t *cap, const char *dir,
+	  const char *name, int isdir)
+{
+	if (*n == *cap) {
+		size_t c = *cap ? *cap * 2 : 256;
+		struct pollfile *p = realloc(*files, c * sizeof(*p));
+		if (!p)
+			return -1;
+		*files = p;
+		*cap = c;
+	}
+
+	size_t len = strlen(dir);
+	struct pollfile *f = &(*files)[*n];
+	if (asprintf(&f->path, "%s%s%s", dir,
+		     !name || (len && dir[len - 1] == '/') ? "" : "/",
+		     name ? name : "") < 0)
+		return -1;
+
+	f->dir = isdir;
+	f->known = 0;
+	(*n)++;
+	return 0;
+}
+
+/*
+ *	List the files to poll, which are those watched with inotify and, for
+ *	-r, everything in the tree. Files listed before keep their states, so
+ *	changes in between are still noticed.
+ */
+static void
+poll_build(void)
+{
+	struct pollfile *files = NULL;
+	size_t n = 0, cap = 0;
+	int err = 0;
+
+	if (G.worker.treewd < 0)
+		err |= poll_push(&files, &n, &cap, G.worker.path, NULL, 0);
+
+	for (int i = 0; i < WATCH_BUCKETS; i++) {
+		for (struct watchdir *w = G.worker.dirs[i]; w; w = w->next) {
+			if (!w->tree)
+				continue;
+
+			err |= poll_push(&files, &n, &cap, w->path, NULL, 1);
+
+			DIR *d = opendir(w->path);
+			struct dirent *e;
+			while (d && (e = readdir(d))) {
+				if (e->d_name[0] != '.' && e->d_type != DT_DIR)
+					err |= poll_push(&files, &n, &cap,
+							 w->path, e->d_name, 0);
+			}
+			if (d)
+				closedir(d);
+		}
+	}
+
+	for (int i = 0; i < DEP_BUCKETS; i++) {
+		for (struct dep *d = G.worker.deps[i]; d; d = d->next) {
+			struct watchdir *w = watchdir_find(d->wd);
+			if (w)
+				err |= poll_push(&files, &n, &cap, w->path,
+						 d->name, 0);
+		}
+	}
+
+	/* out of memory, keep polling the old ones and retry next time */
+	if (err) {
+		for (size_t i = 0; i < n; i++)
+			free(files[i].path);
+		free(files);
+		return;
+	}
+
+	qsort(files, n, sizeof(*files), pollfile_cmp);
+	for (size_t i = 0; i < n; i++) {
+		struct pollfile *old = bsearch(&files[i], G.poll.files,
+					       G.poll.n, sizeof(*old),
+					       pollfile_cmp);
+		if (old && old->known) {
+			files[i].known = 1;
+			files[i].st = old->st;
+		}
+	}
+
+	for (size_t i = 0; i < G.poll.n; i++)
+		free(G.poll.files[i].path);
+	free(G.poll.files);
+
+	G.poll.files = files;
+	G.poll.n = n;
+	G.poll.dirty = 0;
+	atomic_store(&G.poll.nfiles, n);
+}
+
+#ifndef ZVIEWER_NO_URING
+/*
+ *	Stat a batch of files into G.poll.stx, in one io_uring_enter() if
+ *	the kernel supports IORING_OP_STATX. Returns -1 if it doesn't.
+ */
+static int
+poll_stat_uring(struct pollfile *files, int n)
+{
+	struct uring *r = &G.poll.ring;
+	for (int i = 0; i < n; i++) {
+		struct io_uring_sqe *sqe = uring_sqe(r);
+		sqe->opcode	= IORING_OP_STATX;
+		sqe->fd		= AT_FDCWD;
+		sqe->addr	= (unsigned long)files[i].path;
+		sqe->len	= STATX_BASIC_STATS;
+		sqe->off	= (unsigned long)&G.poll.stx[i];
+		sqe->user_data	= i;
+	}
+
+	int unsupported = 0;
+	for (int done = 0; done < n;) {
+		if (uring_enter(r, n - done) < 0) {
+			fail_if(errno != EINTR, "failed to poll files");
+			continue;
+		}
+
+		unsigned head = *r->cqHead;
+		unsigned tail = atomic_load_explicit(
+					(_Atomic unsigned *)r->cqTail,
+					memory_order_acquire);
+		for (; head != tail; head++, done++) {
+			struct io_uring_cqe *cqe = &r->cqes[head & r->cqMask];
+			if (cqe->res == -EINVAL)
+				unsupported = 1;
+			else if (cqe->res < 0)
+				G.poll.errs[cqe->user_data] = -cqe->res;
+		}
+		atomic_store_explicit((_Atomic unsigned *)r->cqHead, head,
+				      memory_order_release);
+	}
+
+	return unsupported ? -1 : 0;
+}
+#endif
+
+/*
+ *	Stat all polled files and compare them against the last round, the
+ *	number of changed ones is returned.
+ */
+static int
+poll_round(void)
+{
+	int changes = 0;
+
+	for (size_t base = 0; base < G.poll.n; base += POLL_BATCH) {
+		struct pollfile *files = G.poll.files + base;
+		int n = G.poll.n - base < POLL_BATCH ? G.poll.n - base
+						       : POLL_BATCH;
+
+		memset(G.poll.errs, 0, sizeof(G.poll.errs));
+
+#ifndef ZVIEWER_NO_URING
+		if (G.poll.uring && poll_stat_uring(files, n)) {
+			close(G.poll.ring.fd);
+			G.poll.uring = 0;
+		}
+		if (!G.poll.uring)
+#endif
+		{
+			for (int i = 0; i < n; i++) {
+				if (statx(AT_FDCWD, files[i].path, 0,
+					  STATX_BASIC_STATS, &G.poll.stx[i]))
+					G.poll.errs[i] = errno;
+			}
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct statx *x = &G.poll.stx[i];
+			int err = G.poll.errs[i];
+			struct filestate st = {
+				.err	= err,
+				.ino	= err ? 0 : x->stx_ino,
+				.size	= err ? 0 : x->stx_size,
+				.sec	= err ? 0 : x->stx_mtime.tv_sec,
+				.nsec	= err ? 0 : x->stx_mtime.tv_nsec,
+			};
+
+			struct pollfile *f = &files[i];
+			if (f->known && memcmp(&f->st, &st, sizeof(st))) {
+				changes++;
+
+				/* pick up new directories and their files */
+				if (f->dir && !st.err) {
+					tree_add(f->path);
+					G.poll.dirty = 1;
+				}
+			}
+			f->st = st;
+			f->known = 1;
+		}
+	}
+
+	return changes;
+}
+
+/*
+ *	A polling round, then the next one is scheduled. A change brings the
+ *	interval back to the shortest, rounds taking long push it further.
+ */
+static void
+poll_files(void)
+{
+	long long start = now_ns();
+
+	if (G.poll.dirty)
+		poll_build();
+
+	int changes = poll_round();
+	if (G.poll.dirty)
+		poll_build();
+
+	long long cost = now_ns() - start;
+	long long interval = changes ? POLL_MIN_NS : G.poll.interval * 3 / 2;
+	if (interval > POLL_MAX_NS)
+		interval = POLL_MAX_NS;
+	if (interval < cost * POLL_DUTY)
+		interval = cost * POLL_DUTY;
+	G.poll.interval = interval;
+
+	atomic_store(&G.poll.cost, cost);
+	atomic_store(&G.poll.period, interval);
+
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec  = interval / 1000000000LL,
+			.tv_nsec = interval % 1000000000LL,
+		},
+	};
+	timerfd_settime(G.poll.fd, 0, &its, NULL);
+
+	if (changes)
+		source_changed(CHANGE_OTHER);
+}
+
+/*
+ *	Events are lost when the queue overflows, the file might have been
+ *	replaced and any dependency changed. Move the watch onto whatever the
+ *	file is now and render again.
+ */
+/*
+ *	Move the watch onto whatever the file is now. The old inode may live on,
+ *	like a backup renamed away, its watch is removed so they don't pile up.
+ */
+static void
+watch_file(void)
+{
+	int wd = inotify_add_watch(G.worker.watchfd, G.worker.path,
+				   FILE_EVENTS);
+	if (wd < 0)
+		return;
+
+	if (G.worker.filewd >= 0 && G.worker.filewd != wd)
+		inotify_rm_watch(G.worker.watchfd, G.worker.filewd);
+	G.worker.filewd = wd;
+}
+
+static void
+watch_rescan(void)
+{
+	if (G.worker.treewd >= 0) {
+		tree_add(G.worker.path);
+		return;
+	}
+
+	watch_file();
+}
+
+/*
+ *	Editors saving by rename, or Vim renaming the old file with a tilde
+ *	suffix if "writebackup" is enabled, replace the file with a new inode.
+ *	The directory is watched as well to find the new file by name and move
+ *	the watch onto it, events of the old one are ignored since then.
+ */
+static int
+handle_event(const struct inotify_event *ep, int *how)
+{
+	struct watchdir *w;
+
+	if (ep->mask & IN_Q_OVERFLOW) {
+		watch_rescan();
+		*how |= CHANGE_OTHER;
+		return 0;
+	}
+
+	/* other files in the directory could be dependencies */
+	if (ep->wd == G.worker.dirwd &&
+	    (!ep->len || !strcmp(ep->name, G.worker.name))) {
+		if (ep->mask & IN_DELETE_SELF) {
+			worker_quit();
+			return 1;
+		}
+
+		if (!ep->len)
+			return 0;
+
+		if (ep->mask & (IN_CREATE | IN_MOVED_TO))
+			watch_file();
+
+		/*
+		 *	A created file is rendered once it's written and closed,
+		 *	which is also seen here in case it's done before the
+		 *	watch is moved. The same event of the file watch comes
+		 *	in the same read and makes no other reload.
+		 */
+		if (ep->mask & IN_MOVED_TO)
+			*how |= CHANGE_OTHER;
+		if (ep->mask & IN_CLOSE_WRITE)
+			*how |= CHANGE_WRITTEN;
+	} else if (ep->wd == G.worker.filewd) {
+		if (ep->mask & IN_MODIFY)
+			*how |= CHANGE_MODIFY;
+		if (ep->mask & IN_CLOSE_WRITE)
+			*how |= CHANGE_WRITTEN;
+	} else if (ep->mask & IN_IGNORED) {
+		/* the directory is removed */
+		if (ep->wd == G.worker.treewd) {
+			worker_quit();
+			return 1;
+		}
+		watchdir_remove(ep->wd);
+	} else if ((w = watchdir_find(ep->wd)) && w->tree) {
+		if (!ep->len || ep->name[0] == '.')
+			return 0;
+
+		size_t len = strlen(w->path);
+		char *sub = ep->mask & IN_ISDIR ? malloc(len + ep->len + 2)
+						: NULL;
+		if (sub)
+			sprintf(sub, "%s%s%s", w->path,
+				len && w->path[len - 1] == '/' ? "" : "/",
+				ep->name);
+
+		/*
+		 *	A directory moved away keeps its watches, under paths
+		 *	that are stale even if it's moved back into the tree.
+		 *	Files in new directories may be there before the watch.
+		 */
+		if (sub && ep->mask & IN_MOVED_FROM)
+			tree_remove(sub);
+		if (sub && ep->mask & (IN_CREATE | IN_MOVED_TO))
+			tree_add(sub);
+		free(sub);
+		*how |= CHANGE_OTHER;
+	} else if (ep->len && ep->mask & DEP_EVENTS &&
+		   dep_find(ep->wd, ep->name)) {
+		*how |= CHANGE_OTHER;
+	}
+
+	return 0;
+}
+
+static void
+curses_init(void)
+{
+	initscr();
+	cbreak();
+	noecho();
+	intrflush(stdscr, FALSE);
+	keypad(stdscr, TRUE);
+	nodelay(stdscr, TRUE);
+	curs_set(0);
+
+	if (has_colors()) {
+		start_color();
+		use_default_colors();
+	}
+
+	G.cursesEnabled = 1;
+}
+
+static void
+curses_cleanup(void)
+{
+	if (G.cursesEnabled)
+		endwin();
+
+	if (G.err > 0)
+		fprintf(stderr, "%s: %s\n", G.msg, strerror(G.err));
+	else if (G.err < 0)
+		fputs(G.msg, stderr);
+}
+
+/*
+ *	Translate SGR attributes into curses ones, allocating color pairs as
+ *	they are first used. Colors beyond what the terminal has, or pairs
+ *	beyond COLOR_PAIRS, fall back to the default colors.
+ */
+static void
+sgr_curses(uint32_t a, attr_t *attrs, short *pair)
+{
+	*attrs = (a & SGR_BOLD		? A_BOLD	: 0) |
+		 (a & SGR_DIM		? A_DIM		: 0) |
+		 (a & SGR_ITALIC	? A_ITALIC	: 0) |
+		 (a & SGR_UNDERLINE	? A_UNDERLINE	: 0) |
+		 (a & SGR_BLINK		? A_BLINK	: 0) |
+		 (a & SGR_REVERSE	? A_REVERSE	: 0) |
+		 (a & SGR_INVIS		? A_INVIS	: 0);
+	*pair = 0;
+
+	if (!(a & (SGR_FG | SGR_BG)) || !has_colors())
+		return;
+
+	int fg = a & SGR_FG ? (int)(a >> SGR_FG_SHIFT & 0xff) : -1;
+	int bg = a & SGR_BG ? (int)(a >> SGR_BG_SHIFT & 0xff) : -1;
+	fg = fg < COLORS ? fg : -1;
+	bg = bg < COLORS ? bg : -1;
+
+	if (!G.pairs) {
+		G.pairs = calloc(257 * 257, sizeof(short));
+		fail_if(!G.pairs, "failed to allocate color pairs");
+	}
+
+	short *p = &G.pairs[(fg + 1) * 257 + bg + 1];
+	if (!*p && G.npairs + 1 < COLOR_PAIRS && G.npairs < SHRT_MAX) {
+		*p = ++G.npairs;
+		init_pair(*p, fg, bg);
+	}
+	*pair = *p;
+}
+
+/* attributes at byte off of line i, *k caches the run to start from */
+static uint32_t
+run_attr(const struct line *line, size_t off, unsigned *k)
+{
+	const struct run *runs = G.snap->runs + line->runs;
+
+	while (*k + 1 < line->nruns && runs[*k + 1].off <= off)
+		(*k)++;
+	return line->nruns && runs[*k].off <= off ? runs[*k].attr : 0;
+}
+
+static void
+prep_unlink(struct prepared *p)
+{
+	*(p->prev ? &p->prev->next : &G.prep.head) = p->next;
+	*(p->next ? &p->next->prev : &G.prep.tail) = p->prev;
+}
+
+static void
+prep_push(struct prepared *p)
+{
+	p->prev = NULL;
+	p->next = G.prep.head;
+	*(p->next ? &p->next->prev : &G.prep.tail) = p;
+	G.prep.head = p;
+}
+
+static void
+prep_evict(void)
+{
+	struct prepared *p = G.prep.tail;
+	struct prepared **pp = &G.prep.buckets[p->hash % PREP_BUCKETS];
+
+	while (*pp != p)
+		pp = &(*pp)->hnext;
+	*pp = p->hnext;
+
+	prep_unlink(p);
+	G.prep.ncells -= p->ncells;
+	free(p);
+}
+
+/*
+ *	Look up the display form of line i, converting the line on a miss.
+ *	Returns NULL for lines too long to be cached, which are laid out on
+ *	every draw instead.
+ */
+static struct prepared *
+prep_get(size_t i)
+{
+	const struct line *line = &G.snap->lines[i];
+	struct prepared **head = &G.prep.buckets[line->hash % PREP_BUCKETS];
+
+	for (struct prepared *p = *head; p; p = p->hnext) {
+		if (p->hash == line->hash && p->len == line->len &&
+		    p->attr == line->attr) {
+			G.prep.hits++;
+			prep_unlink(p);
+			prep_push(p);
+			return p;
+		}
+	}
+
+	G.prep.misses++;
+	if (line->width > PREP_LINE_CELLS)
+		return NULL;
+
+	/* a cell takes at least a byte */
+	struct prepared *p = malloc(sizeof(*p) + sizeof(struct cell) * line->len);
+	fail_if(!p, "failed to prepare the line");
+
+	struct layout l;
+	struct glyph g;
+	layout_init(&l, G.snap->text + line->off, line->len, INT_MAX);
+
+	unsigned k = 0;
+	p->ncells = 0;
+	while (layout_next(&l, &g)) {
+		struct cell *c = &p->cells[p->ncells++];
+		wchar_t wcs[2] = { g.wc, 0 };
+		attr_t attrs;
+		short pair;
+
+		sgr_curses(run_attr(line, g.p - l.start, &k), &attrs, &pair);
+
+		c->col		= g.x;
+		c->width	= g.width;
+		c->kind		= g.wc ? CELL_CHAR : *g.p == '\t' ? CELL_TAB :
+								     CELL_CTRL;
+		if (c->kind == CELL_CTRL)
+			wcs[0] = *g.p == 0x7f ? L'?' : *g.p + '@';
+		setcchar(&c->cc, wcs, attrs, pair, NULL);
+	}
+
+	struct prepared *shrunk = realloc(p, sizeof(*p) +
+					  sizeof(struct cell) * p->ncells);
+	p = shrunk ? shrunk : p;
+
+	p->hash	= line->hash;
+	p->len	= line->len;
+	p->attr	= line->attr;
+	p->hnext = *head;
+	*head	= p;
+	prep_push(p);
+
+	G.prep.ncells += p->ncells;
+	while (G.prep.ncells > PREP_MAX_CELLS && G.prep.tail != p)
+		prep_evict();
+
+	return p;
+}
+
+static void
+draw_cell(int y, int x, const struct cell *c)
+{
+	if (c->kind == CELL_CTRL) {
+		wchar_t wcs[CCHARW_MAX];
+		attr_t attrs;
+		short pair;
+
+		getcchar(&c->cc, wcs, &attrs, &pair, NULL);
+		attr_set(attrs, pair, NULL);
+		mvaddch(y, x, '^');
+		attr_set(A_NORMAL, 0, NULL);
+		add_wch(&c->cc);
+	} else if (c->kind == CELL_CHAR) {
+		mvadd_wch(y, x, &c->cc);
+	}
+}
+
+/* draw n bytes of a plain line as they are, no conversion needed */
+static void
+draw_plain(int y, int x, const char *p, int n)
+{
+	static chtype *cells;
+	static int ncells;
+
+	if (n <= 0)
+		return;
+
+	if (n > ncells) {
+		cells = realloc(cells, sizeof(chtype) * n);
+		fail_if(!cells, "failed to draw the screen");
+		ncells = n;
+	}
+
+	for (int i = 0; i < n; i++)
+		cells[i] = (unsigned char)p[i];
+	mvaddchnstr(y, x, cells, n);
+}
+
+static void
+draw_glyph(int y, int x, const struct glyph *g, uint32_t attr)
+{
+	attr_t attrs;
+	short pair;
+	sgr_curses(attr, &attrs, &pair);
+
+	if (g->wc) {
+		cchar_t cc;
+		wchar_t wcs[2] = { g->wc, 0 };
+		setcchar(&cc, wcs, attrs, pair, NULL);
+		mvadd_wch(y, x, &cc);
+	} else if (*g->p != '\t') {
+		attr_set(attrs, pair, NULL);
+		mvaddch(y, x, '^');
+		addch(*g->p == 0x7f ? '?' : *g->p + '@');
+		attr_set(A_NORMAL, 0, NULL);
+	}
+}
+
+/* lines drawn byte by byte, with no attributes to apply */
+static int
+line_direct(const struct line *line)
+{
+	return line->flags & LINE_PLAIN && !line->nruns;
 }
 
-static char **
-do_render(size_t *rlines)
+/* draw rows [skip, skip + maxRows) of line i at row y of the screen */
+static int
+draw_line(size_t i, int skip, int y, int maxRows)
 {
-	int pipefds[2];
-	fail_if(pipe(pipefds) < 0, "failed to create pipe");
+	const struct line *line = &G.snap->lines[i];
+	int cols = G.view.cols, x0 = G.view.gutter;
 
-	int pid = fork();
+	if (line_direct(line)) {
+		int rows = line_rows(i) - skip;
+		rows = rows < maxRows ? rows : maxRows;
 
-	fail_if(pid < 0, "failed to run the render");
+		for (int r = 0; r < rows; r++) {
+			size_t off = (size_t)(skip + r) * cols;
+			size_t n = line->len - off;
+			draw_plain(y + r, x0, G.snap->text + line->off + off,
+				   n < (size_t)cols ? (int)n : cols);
+		}
+		return rows;
+	}
 
-	if (pid) {
-		/* parent */
-		close(pipefds[1]);
+	struct layout l;
+	struct prepared *p = prep_get(i);
+	layout_init(&l, G.snap->text + line->off, line->len, cols);
 
-		FILE *rfp = fdopen(pipefds[0], "rb");
-		fail_if(!rfp, "cannot read from the render");
+	if (p) {
+		for (int k = 0; k < p->ncells; k++) {
+			const struct cell *c = &p->cells[k];
+			int row, x;
+			layout_place(&l, c->width, c->kind == CELL_TAB, &row, &x);
 
-		char **newContents = NULL;
-		char *line = NULL;
-		size_t len = 0;
-		size_t nlines = 0;
-		while (getline(&line, &len, rfp) != -1) {
-			nlines++;
-			newContents = realloc(newContents,
-					      sizeof(char *) * nlines);
-			fail_if(!newContents, "failed to read from the render");
+			if (row < skip)
+				continue;
+			if (row - skip >= maxRows)
+				return maxRows;
 
-			newContents[nlines - 1] = line;
+			draw_cell(y + row - skip, x + x0, c);
+		}
+	} else {
+		struct glyph g;
+		unsigned k = 0;
+		while (layout_next(&l, &g)) {
+			if (g.row < skip)
+				continue;
+			if (g.row - skip >= maxRows)
+				return maxRows;
 
-			len = 0;
-			line = NULL;
+			draw_glyph(y + g.row - skip, g.x + x0, &g,
+				   run_attr(line, g.p - l.start, &k));
 		}
+	}
 
-		fclose(rfp);
+	int rows = layout_rows(&l) - skip;
+	return rows < maxRows ? rows : maxRows;
+}
 
-		int wstatus = 0;
-		fail_if(waitpid(pid, &wstatus, 0) < 0,
-			"failed to read from the render");
+/* draw the slice of line i starting at column G.view.coloff */
+static void
+draw_line_chopped(size_t i, int y)
+{
+	const struct line *line = &G.snap->lines[i];
+	int coloff = G.view.coloff, cols = G.view.cols, x0 = G.view.gutter;
 
-		const char *msg;
-		if (!WIFEXITED(wstatus)) {
-			msg = "render terminated";
-		} else if (WEXITSTATUS(wstatus) != 0) {
-			msg = "render failed";
-		} else {
-			*rlines = nlines;
+	if (line->width <= coloff)
+		return;
 
-			return newContents;
-		}
+	if (line_direct(line)) {
+		int n = line->len - coloff;
+		draw_plain(y, x0, G.snap->text + line->off + coloff,
+			   n < cols ? n : cols);
+		return;
+	}
 
-		if (nlines)
-			asprintf(&G.msg, "%s: %s", msg, newContents[0]);
-		else
-			asprintf(&G.msg, "%s\n", msg);
+	struct prepared *p = prep_get(i);
+	if (p) {
+		/* the first cell starting at or after coloff */
+		int lo = 0, hi = p->ncells;
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			if (p->cells[mid].col < coloff)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
 
-		G.err = -1;
-		exit(-1);
-	} else {
-		/*
-		 *	child (the render)
-		 *	XXX: should we redirect stdin to /dev/null?
-		 */
-		close(STDOUT_FILENO);
-		close(STDERR_FILENO);
+		for (; lo < p->ncells; lo++) {
+			const struct cell *c = &p->cells[lo];
+			if (c->col + c->width > coloff + cols)
+				break;
+			draw_cell(y, c->col - coloff + x0, c);
+		}
+		return;
+	}
 
-		close(pipefds[0]);
+	struct colmark m = colidx_find(i, coloff);
+	struct layout l;
+	struct glyph g;
+	layout_init(&l, G.snap->text + m.off, line->len - (m.off - line->off),
+		    INT_MAX);
+	l.col = l.x = m.col;
 
-		if (dup2(pipefds[1], STDOUT_FILENO) < 0)
-			exit(-1);
-		if (dup2(pipefds[1], STDERR_FILENO) < 0)
-			exit(-1);
+	unsigned k = 0;
+	while (layout_next(&l, &g)) {
+		if (g.x < coloff)
+			continue;
+		if (g.x + g.width > coloff + cols)
+			break;
 
-		fail_if(execvp(G.renderCmd[0], (char **)G.renderCmd),
-			"failed to execute render");
+		draw_glyph(y, g.x - coloff + x0, &g,
+			   run_attr(line, g.p - G.snap->text - line->off, &k));
 	}
-
-	return 0;	// never reaches here
 }
 
+/*
+ *	Reverse matches of the search in line i, whose rows from skip on are
+ *	drawn from row y, maxRows at most. Matches are only looked for in lines
+ *	drawn, which are searched as soon as they are.
+ */
 static void
-set_rowoff(int y)
+draw_matches(size_t i, int skip, int y, int maxRows)
 {
-	if (y < 0)
-		y = 0;
-	else if (G.nlines <= (size_t)LINES)
-		y = 0;
-	else if ((size_t)y >= G.nlines - (size_t)LINES)
-		y = G.nlines - LINES;
-	G.rowoff = y;
-}
+	const struct line *line = &G.snap->lines[i];
+	const char *text = G.snap->text + line->off;
 
-static void
-do_reload(void)
-{
-	size_t nlines;
-	char **newContents = do_render(&nlines);
+	if (!G.search.pat.len || !search_line(i))
+		return;
 
-	delwin(G.pad);
-	G.pad = newpad(nlines + 1, COLS);
+	int chop = G.view.chop, coloff = chop ? G.view.coloff : 0;
+	int cols = G.view.cols;
+	struct layout l;
+	struct glyph g;
+	layout_init(&l, text, line->len, chop ? INT_MAX : cols);
 
-	for (size_t i = 0; i < nlines; i++)
-		waddstr(G.pad, newContents[i]);
+	const struct pattern *pt = &G.search.pat;
+	size_t end, start = pattern_find(pt, text, line->len, 0, &end);
+	while (start != SIZE_MAX && layout_next(&l, &g)) {
+		size_t off = g.p - text;
 
-	/* looking for the changed part and move the focus to it */
-	int rowoff = -1;
+		/* empty matches are skipped */
+		while (start != SIZE_MAX && off >= end)
+			start = pattern_find(pt, text, line->len,
+					     end > start ? end : start + 1, &end);
 
-	/* check for changes in the prefix */
-	for (size_t i = 0; i < G.nlines && i < nlines; i++) {
-		if (strcmp(G.contents[i], newContents[i])) {
-			rowoff = i;
+		if (start == SIZE_MAX || off < start)
+			continue;
+		if (g.row - skip < 0 || g.x < coloff)
+			continue;
+		if (g.row - skip >= maxRows || g.x + g.width > coloff + cols)
 			break;
-		}
-	}
 
-	if (rowoff < 0) {
-		if (!G.contents)		// first load
-			rowoff = 0;
-		else if (G.nlines != nlines)	// append/delete at tail
-			rowoff = nlines;
-		else
-			rowoff = G.rowoff;
+		cchar_t cc;
+		wchar_t wcs[CCHARW_MAX];
+		attr_t attrs;
+		short pair;
+
+		mvin_wch(y + g.row - skip, g.x - coloff + G.view.gutter, &cc);
+		getcchar(&cc, wcs, &attrs, &pair, NULL);
+		setcchar(&cc, wcs, attrs ^ A_REVERSE, pair, NULL);
+		add_wch(&cc);
 	}
+}
+
+/* headings listed over the screen, the selected one in reverse video */
+static void
+draw_outline(void)
+{
+	size_t n = G.snap->nheads;
+	size_t first = G.outline.sel > (size_t)LINES / 2 ?
+		       G.outline.sel - LINES / 2 : 0;
+
+	if (n > (size_t)LINES && first > n - LINES)
+		first = n - LINES;
+
+	if (!n)
+		mvaddstr(0, 0, "No sections");
 
-	for (size_t i = 0; i < G.nlines; i++)
-		free(G.contents[i]);
-	free(G.contents);
+	for (int y = 0; y < LINES && first + y < n; y++) {
+		size_t k = first + y;
+		const struct line *line = &G.snap->lines[G.snap->heads[k]];
+		struct layout l;
+		struct glyph g;
 
-	G.contents = newContents;
-	G.nlines = nlines;
+		if (k == G.outline.sel)
+			attron(A_REVERSE);
 
-	set_rowoff(rowoff);
+		mvprintw(y, 0, "%7zu ", G.snap->heads[k] + 1);
+		layout_init(&l, G.snap->text + line->off, line->len, INT_MAX);
+		while (layout_next(&l, &g) && g.x + g.width <= COLS - 8)
+			draw_glyph(y, g.x + 8, &g,
+				   k == G.outline.sel ? SGR_REVERSE : 0);
+		clrtoeol();
+
+		attroff(A_REVERSE);
+	}
 }
 
 /*
- *	TODO: Vim renames the old file with a tlide suffix if "writebackup"
- *	is enabled. Don't consider the original file is lost in this case.
+ *	Diagnostics of the render over the bottom of the screen, the last lines
+ *	as errors usually come last. Only the title is left if a failed render
+ *	is hidden.
  */
-static int
-handle_event(struct inotify_event *ep)
+static void
+draw_diag(void)
 {
-	if (ep->mask & IN_DELETE_SELF)
-		return 1;
+	const struct diag *d = G.diag.d;
+	const struct snapshot *out = d->out;
+	int failed = diag_failed(d);
+	char title[80];
 
-	do_reload();
-	return 0;
+	if (!failed && (!out || !G.diag.shown))
+		return;
+
+	if (d->breach[0])
+		snprintf(title, sizeof(title), "%s", d->breach);
+	else if (WIFSIGNALED(d->wstatus))
+		snprintf(title, sizeof(title), "render terminated: %s",
+			 strsignal(WTERMSIG(d->wstatus)));
+	else if (failed)
+		snprintf(title, sizeof(title), "render failed with status %d",
+			 WEXITSTATUS(d->wstatus));
+	else
+		snprintf(title, sizeof(title), "render printed to stderr");
+
+	size_t n = G.diag.shown && out ? out->nlines : 0;
+	if (n > (size_t)LINES / 2)
+		n = LINES / 2;
+
+	int y = LINES - n - 1;
+	attron(A_REVERSE);
+	mvprintw(y, 0, "%s, E to %s", title, G.diag.shown ? "hide" : "show");
+	clrtoeol();
+	attroff(A_REVERSE);
+
+	if (!n)
+		return;
+
+	for (size_t k = out->nlines - n; k < out->nlines; k++) {
+		const struct line *line = &out->lines[k];
+		struct layout l;
+		struct glyph g;
+
+		move(++y, 0);
+		clrtoeol();
+		layout_init(&l, out->text + line->off, line->len, INT_MAX);
+		while (layout_next(&l, &g) && g.x + g.width <= COLS)
+			draw_glyph(y, g.x, &g, 0);
+	}
 }
 
+/* only lines on the screen are laid out */
 static void
-curses_init(void)
+draw_screen(void)
 {
-	initscr();
-	cbreak();
-	noecho();
-	intrflush(stdscr, FALSE);
-	keypad(stdscr, TRUE);
-	curs_set(0);
+	erase();
 
-	G.cursesEnabled = 1;
+	struct pos p = G.view.top;
+	if (G.outline.shown) {
+		draw_outline();
+		p.line = view_nlines();		// nothing else to draw
+	}
+
+	for (int y = 0; y < LINES && p.line < view_nlines(); p.line++) {
+		size_t i = view_line(p.line);
+
+		if (G.view.gutter && (G.view.chop || !p.sub)) {
+			attron(A_DIM);
+			mvprintw(y, 0, "%*zu", G.view.gutter - 1, i + 1);
+			attroff(A_DIM);
+		}
+
+		if (G.view.chop) {
+			draw_line_chopped(i, y);
+			draw_matches(i, 0, y++, 1);
+		} else {
+			int rows = draw_line(i, p.sub, y, LINES - y);
+			draw_matches(i, p.sub, y, rows);
+			y += rows;
+			p.sub = 0;
+		}
+	}
+
+	if (G.diag.d)
+		draw_diag();
+
+	if (G.view.msg[0]) {
+		attron(A_REVERSE);
+		mvaddnstr(LINES - 1, 0, G.view.msg, COLS);
+		clrtoeol();
+		attroff(A_REVERSE);
+	}
+
+	if (G.prompt.kind) {
+		mvaddch(LINES - 1, 0, G.prompt.kind);
+		addnstr(G.prompt.buf, G.prompt.len);
+		clrtoeol();
+	}
+
+	refresh();
 }
 
 static void
-curses_cleanup(void)
+prompt_key(int key)
 {
-	if (G.cursesEnabled) {
-		delwin(G.pad);
-		endwin();
-	}
+	int kind = G.prompt.kind;
 
-	if (G.err > 0)
-		fprintf(stderr, "%s: %s\n", G.msg, strerror(G.err));
-	else if (G.err < 0)
-		fputs(G.msg, stderr);
+	switch (key) {
+	case '\n':
+	case '\r':
+	case KEY_ENTER:
+		G.prompt.kind = 0;
+
+		G.prompt.buf[G.prompt.len] = '\0';
+		if (kind == '&') {
+			filter_start(G.prompt.buf, G.prompt.len);
+			break;
+		} else if (kind == '#') {
+			if (G.prompt.len)
+				outline_goto(G.prompt.buf, G.prompt.len);
+			break;
+		}
+
+		/* an empty pattern repeats the last search */
+		if (!G.prompt.len)
+			G.search.backward = kind == '?';
+		else if (search_start(G.prompt.buf, G.prompt.len, kind == '?'))
+			break;
+		search_next(G.search.backward);
+		break;
+	case '\033':
+		G.prompt.kind = 0;
+		break;
+	case KEY_BACKSPACE:
+	case '\b':
+	case 0x7f:
+		if (!G.prompt.len)
+			G.prompt.kind = 0;
+
+		/* drop a whole UTF-8 sequence */
+		while (G.prompt.len &&
+		       (G.prompt.buf[--G.prompt.len] & 0xc0) == 0x80)
+			;
+		break;
+	default:
+		if (key >= 0x20 && key <= 0xff && G.prompt.len + 1 < PROMPT_MAX)
+			G.prompt.buf[G.prompt.len++] = key;
+		break;
+	}
 }
 
 static void
-draw_screen(void)
+outline_key(int key)
 {
-	erase();
-	refresh();
-	prefresh(G.pad, G.rowoff, 0, 0, 0, LINES - 1, COLS);
+	size_t n = G.snap->nheads;
+
+	switch (key) {
+	case 'j':
+	case KEY_DOWN:
+		if (G.outline.sel + 1 < n)
+			G.outline.sel++;
+		break;
+	case 'k':
+	case KEY_UP:
+		if (G.outline.sel > 0)
+			G.outline.sel--;
+		break;
+	case '\n':
+	case '\r':
+	case KEY_ENTER:
+		if (G.outline.sel < n)
+			goto_line(G.snap->heads[G.outline.sel]);
+		G.outline.shown = 0;
+		break;
+	case 'o':
+	case 'q':
+	case '\033':
+		G.outline.shown = 0;
+		break;
+	}
 }
 
+/*
+ *	Keys could be prefixed with a count like in vi, 20j scrolls 20 rows
+ *	down and 500G goes to line 500.
+ */
 static void
 handle_key(int key)
 {
 	static int last_key;
+	static int count;
+
+	G.view.msg[0] = '\0';
+
+	if (G.prompt.kind && key != KEY_RESIZE) {
+		prompt_key(key);
+		return;
+	}
+
+	if (G.outline.shown && key != KEY_RESIZE) {
+		outline_key(key);
+		return;
+	}
+
+	if ((last_key == 'm' || last_key == '\'') && key != KEY_RESIZE) {
+		if (last_key == 'm' && key >= 'a' && key <= 'z')
+			mark_set(key - 'a', top_line());
+		else if (key >= 'a' && key <= 'z')
+			mark_goto(key - 'a');
+		else if (key == '\'')
+			mark_goto(26);
+
+		last_key = 0;
+		return;
+	}
+
+	if ((key >= '1' && key <= '9') || (key == '0' && count)) {
+		if (count < INT_MAX / 10)
+			count = count * 10 + key - '0';
+		last_key = 0;
+		return;
+	}
+
+	/* the count, 0 if there isn't any */
+	int n = count;
+	count = 0;
+
+	/* prefixes only apply to the very next key */
+	int prev = last_key;
+	last_key = 0;
+
 	switch (key) {
 	case 'j':
 	case KEY_DOWN:
-		set_rowoff(G.rowoff + 1);
+		scroll_rows(n ? n : 1);
 		break;
 	case 'k':
 	case KEY_UP:
 	case KEY_ENTER:
-		set_rowoff(G.rowoff - 1);
+		scroll_rows(n ? -n : -1);
 		break;
 	case 'u':
 	case KEY_NPAGE:
-		set_rowoff(G.rowoff - LINES / 2);
+		n = n < INT_MAX / LINES ? n : INT_MAX / LINES;
+		scroll_rows(-LINES / 2 * (n ? n : 1));
 		break;
 	case 'd':
 	case KEY_PPAGE:
-		set_rowoff(G.rowoff + LINES / 2);
+		n = n < INT_MAX / LINES ? n : INT_MAX / LINES;
+		scroll_rows(LINES / 2 * (n ? n : 1));
 		break;
 	case 'g':
-		if (last_key == 'g') {
-			set_rowoff(0);
-			last_key = 0;
+		if (prev == 'g') {
+			goto_line(n ? n - 1 : 0);
 		} else {
+			count = n;
 			last_key = key;
 		}
 		break;
 	case 'G':
-		set_rowoff(G.nlines);
+		goto_line(n ? (size_t)n - 1 : G.snap->nlines);
+		break;
+	case 'h':
+	case KEY_LEFT:
+		set_coloff(G.view.coloff - G.view.cols / 2);
+		break;
+	case 'l':
+	case KEY_RIGHT:
+		set_coloff(G.view.coloff + G.view.cols / 2);
+		break;
+	case '0':
+		set_coloff(0);
+		break;
+	case '$':
+		set_coloff(INT_MAX);
+		break;
+	case 'S':
+		toggle_chop();
+		break;
+	case '/':
+	case '?':
+	case '&':
+	case '#':
+		G.prompt.kind = key;
+		G.prompt.len = 0;
+		break;
+	case 'n':
+		do
+			search_next(G.search.backward);
+		while (--n > 0 && !G.view.msg[0]);
+		break;
+	case 'N':
+		/* -N like in less */
+		if (prev == '-') {
+			toggle_numbers();
+			break;
+		}
+
+		do
+			search_next(!G.search.backward);
+		while (--n > 0 && !G.view.msg[0]);
+		break;
+	case ']':
+		do
+			outline_next(0);
+		while (--n > 0 && !G.view.msg[0]);
+		break;
+	case '[':
+		do
+			outline_next(1);
+		while (--n > 0 && !G.view.msg[0]);
+		break;
+	case 'o':
+		outline_toggle();
+		break;
+	case 'E':
+		if (G.diag.d && (G.diag.d->out || diag_failed(G.diag.d)))
+			G.diag.shown = !G.diag.shown;
+		else
+			show_msg("No diagnostics");
+		break;
+	case '=': {
+		char stats[80] = "";
+		if (G.poll.enabled)
+			snprintf(stats, sizeof(stats),
+				 ", polling %zu files in %lldus every %lldms",
+				 atomic_load(&G.poll.nfiles),
+				 atomic_load(&G.poll.cost) / 1000,
+				 atomic_load(&G.poll.period) / 1000000);
+
+		show_msg("%zu of %zu lines, %zu%s matches, line cache: %lu "
+			 "hits, %lu misses, %zu cells%s", view_nlines(),
+			 G.snap->nlines, G.search.nmatches,
+			 G.search.unknown ? "+" : "", G.prep.hits,
+			 G.prep.misses, G.prep.ncells, stats);
+		break;
+	}
+	case KEY_RESIZE:
+		handle_resize();
+		last_key = prev;
 		break;
 	case 'q':
 		exit(0);
@@ -274,79 +5535,402 @@ handle_key(int key)
 	}
 }
 
+static int
+handle_inotify(char *buf, ssize_t len)
+{
+	fail_if(len <= 0, "failed to read inotify event");
+
+	/* events read at once make a single reload */
+	int how = 0;
+	for (char *p = buf; len;) {
+		struct inotify_event *ep = (struct inotify_event *)p;
+
+		if (handle_event(ep, &how))
+			return 1;
+
+		len -= sizeof(*ep) + ep->len;
+		p += sizeof(*ep) + ep->len;
+	}
+
+	if (how)
+		source_changed(how);
+	return 0;
+}
+
+/*
+ *	The worker runs the render and ingests its output, the UI thread is
+ *	only signaled once a new snapshot is ready.
+ */
+static void *
+worker_main(void *arg)
+{
+	(void)arg;
+	inWorker = 1;
+
+	io_init();
+	io_arm(G.worker.settlefd, EV_SETTLE);
+
+	/* inotify is still used to identify the watched files */
+	if (G.poll.enabled) {
+#ifndef ZVIEWER_NO_URING
+		G.poll.uring = !G.forceEpoll &&
+			       uring_init(&G.poll.ring, POLL_BATCH,
+					  IORING_OP_STATX) >= 0;
+#endif
+		poll_files();
+		io_arm(G.poll.fd, EV_POLL);
+	} else {
+		io_arm(G.worker.watchfd, EV_INOTIFY);
+	}
+
+	if (G.limit.time)
+		io_arm(G.limit.timerfd, EV_TIMEOUT);
+	io_arm(G.worker.sigfd, EV_CHILD);
+
+	render_start();
+
+	for (;;) {
+		struct io_event evs[EV_NR];
+		int n = io_wait(evs, EV_NR);
+
+		for (int i = 0; i < n; i++) {
+			struct io_event *ev = &evs[i];
+
+			switch (ev->tag) {
+			case EV_INOTIFY:
+				if (handle_inotify(ev->buf, ev->res))
+					return NULL;
+				io_arm(G.worker.watchfd, EV_INOTIFY);
+				break;
+			case EV_RENDER:
+				fail_if(ev->res < 0,
+					"failed to read from the render");
+				if (ev->res) {
+					render_append(ev->buf, ev->res);
+					io_arm(G.render.fd, EV_RENDER);
+					break;
+				}
+
+				close(G.render.fd);
+				G.render.fd = -1;
+				if (render_done())
+					render_finish();
+				break;
+			case EV_STDERR:
+				if (ev->res > 0) {
+					errlog_append(ev->buf, ev->res);
+					io_arm(G.render.errfd, EV_STDERR);
+					break;
+				}
+
+				close(G.render.errfd);
+				G.render.errfd = -1;
+				if (render_done())
+					render_finish();
+				break;
+			case EV_TRACE:
+				if (ev->res > 0) {
+					trace_read(ev->buf, ev->res);
+					io_arm(G.trace.fd, EV_TRACE);
+					break;
+				}
+
+				trace_finish();
+				if (render_done())
+					render_finish();
+				break;
+			case EV_SETTLE:
+				io_arm(G.worker.settlefd, EV_SETTLE);
+				if (G.worker.treewd >= 0) {
+					G.worker.burst = 0;
+					request_reload();
+				} else if (G.render.spec) {
+					render_commit();
+				}
+				break;
+			case EV_POLL:
+				poll_files();
+				io_arm(G.poll.fd, EV_POLL);
+				break;
+			case EV_TIMEOUT:
+				render_timeout();
+				io_arm(G.limit.timerfd, EV_TIMEOUT);
+				break;
+			case EV_CHILD:
+				io_arm(G.worker.sigfd, EV_CHILD);
+				if (G.render.pid && render_done())
+					render_finish();
+				break;
+			default:
+				abort();	// never reaches here
+			}
+		}
+	}
+}
+
 int
-main(int argc, const char *argv[])
+main(int argc, char *argv[])
 {
-	if (argc < 3) {
+	/* man page sections and Markdown headings by default */
+	static char heading[PROMPT_MAX] = "^(#+ |[A-Z][A-Z0-9 ]*$)";
+	int opt, nheading = 0, ndeps = 0, trace = 0, tree = 0, polling = 0;
+	const char *cgroup = NULL;
+	int weight = 0;
+	const char **deps = calloc(argc, sizeof(char *));
+	if (!deps) {
+		perror("failed to allocate memory");
+		return -1;
+	}
+
+	G.sched.policy = SCHED_OTHER;
+	G.sched.procsfd = -1;
+	while ((opt = getopt(argc, argv, "+d:eH:l:NpP:rSt")) != -1) {
+		switch (opt) {
+		case 'd':
+			deps[ndeps++] = optarg;
+			break;
+		case 'e':
+			G.forceEpoll = 1;
+			break;
+		case 'l':
+			if (parse_limits(optarg))
+				return -1;
+			break;
+		case 'N':
+			G.view.numbers = 1;
+			break;
+		case 'H': {
+			/* more patterns are joined as alternatives */
+			size_t len = nheading++ ? strlen(heading) : 0;
+			int n = snprintf(heading + len, sizeof(heading) - len,
+					 "%s%s", len ? "|" : "", optarg);
+			if (n < 0 || (size_t)n >= sizeof(heading) - len) {
+				fputs("heading patterns are too long\n", stderr);
+				return -1;
+			}
+			break;
+		}
+		case 'p':
+			polling = 1;
+			break;
+		case 'P':
+			if (parse_priority(optarg, &cgroup, &weight))
+				return -1;
+			break;
+		case 'r':
+			tree = 1;
+			break;
+		case 'S':
+			G.view.chop = 1;
+			break;
+		case 't':
+			trace = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (argc - optind < 2) {
 		usage(argv[0]);
 		return -1;
 	}
 
 	setlocale(LC_ALL, "");
+	sgr_init();
+
+	const char *err;
+	if (pattern_set(&G.outline.pat, heading, strlen(heading), &err)) {
+		fprintf(stderr, "invalid heading pattern: %s\n", err);
+		return -1;
+	}
+
+	if (weight && !cgroup) {
+		fputs("weight is only for a cgroup\n", stderr);
+		return -1;
+	}
+	if (cgroup && cgroup_init(cgroup, weight))
+		return -1;
 
-	G.cmdLen = argc - 2;
-	G.renderCmd = argv + 2;
+	G.cmdLen = argc - optind - 1;
+	G.renderCmd = (const char **)argv + optind + 1;
+
+	G.trace.fd = -1;
+	if (trace && trace_init())
+		return -1;
 
-	int watchfd = inotify_init1(IN_NONBLOCK);
+	/* blocking, reads are only issued once it's readable */
+	int watchfd = inotify_init1(IN_CLOEXEC);
 	if (watchfd < 0) {
 		perror("failed to create inotify instance");
 		return -1;
 	}
 
-	const char *file = argv[1];
-	int watchid = inotify_add_watch(watchfd, file, IN_CLOSE_WRITE	|
-						       IN_MODIFY	|
-						       IN_DELETE_SELF);
-	if (watchid < 0) {
-		fprintf(stderr, "failed to watch %s: %s\n", file,
-							    strerror(errno));
+	const char *file = argv[optind];
+	G.worker.watchfd = watchfd;
+	G.worker.path = file;
+	G.worker.treewd = -1;
+	G.worker.settlefd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (G.worker.settlefd < 0) {
+		perror("failed to create timerfd");
+		return -1;
+	}
+
+	if (tree) {
+		G.worker.filewd = G.worker.dirwd = -1;
+		G.worker.treewd = inotify_add_watch(watchfd, file,
+						    TREE_EVENTS | IN_ONLYDIR);
+		if (G.worker.treewd < 0 || tree_add(file)) {
+			fprintf(stderr, "failed to watch %s: %s\n", file,
+				strerror(errno));
+			return -1;
+		}
+	} else {
+		G.worker.filewd = inotify_add_watch(watchfd, file, FILE_EVENTS);
+		if (G.worker.filewd < 0) {
+			fprintf(stderr, "failed to watch %s: %s\n", file,
+				strerror(errno));
+			return -1;
+		}
+
+		/* the directory, to follow the file being replaced */
+		const char *slash = strrchr(file, '/');
+		char *dir = slash ? strndup(file, slash - file + 1)
+				  : strdup(".");
+		G.worker.dirwd = dir ? inotify_add_watch(watchfd, dir,
+							 DIR_EVENTS) : -1;
+		if (G.worker.dirwd < 0) {
+			fprintf(stderr,
+				"failed to watch the directory of %s: %s\n",
+				file, strerror(errno));
+			return -1;
+		}
+		free(dir);
+
+		G.worker.name = slash ? slash + 1 : file;
+	}
+
+	/* patterns matching nothing are taken as files to be created */
+	for (int i = 0; i < ndeps; i++) {
+		glob_t g;
+		if (glob(deps[i], GLOB_NOCHECK, NULL, &g)) {
+			fprintf(stderr, "failed to expand %s\n", deps[i]);
+			return -1;
+		}
+
+		for (size_t k = 0; k < g.gl_pathc; k++) {
+			if (!dep_add(g.gl_pathv[k], 0)) {
+				fprintf(stderr, "failed to watch %s: %s\n",
+					g.gl_pathv[k], strerror(errno));
+				return -1;
+			}
+		}
+		globfree(&g);
+	}
+	free(deps);
+
+	if (G.limit.time) {
+		G.limit.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (G.limit.timerfd < 0) {
+			perror("failed to create timerfd");
+			return -1;
+		}
+	}
+
+	if (polling) {
+		G.poll.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (G.poll.fd < 0) {
+			perror("failed to create timerfd");
+			return -1;
+		}
+
+		G.poll.enabled = 1;
+		G.poll.dirty = 1;
+		G.poll.interval = POLL_MIN_NS;
+	}
+
+	G.worker.wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (G.worker.wakefd < 0) {
+		perror("failed to create eventfd");
+		return -1;
+	}
+
+	/* blocked in both threads, so it's left pending for the signalfd */
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &sigs, &G.worker.sigmask);
+	G.worker.sigfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	if (G.worker.sigfd < 0) {
+		perror("failed to create signalfd");
+		return -1;
+	}
+
+	G.snap = calloc(1, sizeof(*G.snap));
+	G.view.rows = calloc(1, sizeof(struct rowcache));
+	G.view.wrap = calloc(1, sizeof(size_t));
+	if (!G.snap || !G.view.rows || !G.view.wrap) {
+		perror("failed to allocate memory");
 		return -1;
 	}
 
 	curses_init();
 	atexit(curses_cleanup);
+	atexit(render_kill_group);
+	update_cols();
 
-	do_reload();
-	draw_screen();
-
-	fd_set fds;
-	FD_ZERO(&fds);
-	FD_SET(watchfd, &fds);
-	FD_SET(STDIN_FILENO, &fds);
+	struct sigaction sa = { .sa_handler = handle_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-	int ret = 0;
-	while ((ret = select(FD_SETSIZE + 1, &fds, NULL, NULL, NULL)) >= 0) {
-		if (FD_ISSET(watchfd, &fds)) {
-			char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	/* signals are left to the UI thread, SIGWINCH has to interrupt poll() */
+	sigset_t ui;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGWINCH);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGTSTP);
+	sigaddset(&sigs, SIGCONT);
+	pthread_sigmask(SIG_BLOCK, &sigs, &ui);
+	errno = pthread_create(&G.worker.thread, NULL, worker_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &ui, NULL);
+	fail_if(errno, "failed to create the worker thread");
 
-			ssize_t len = read(watchfd, buf, sizeof(buf));
-			fail_if(len <= 0, "failed to read inotify event");
+	draw_screen();
 
-			for (char *p = buf; len;) {
-				struct inotify_event *ep =
-					(struct inotify_event *)p;
+	struct pollfd fds[] = {
+		{ .fd = STDIN_FILENO,		.events = POLLIN },
+		{ .fd = G.worker.wakefd,	.events = POLLIN },
+	};
+	while (!atomic_load(&G.quit)) {
+		/* searching goes on in chunks as long as nothing happens */
+		int searching = G.search.unknown > 0;
+		int n = poll(fds, 2, searching ? 0 : -1);
 
-				if (handle_event(ep))
-					goto do_exit;
+		/* SIGWINCH interrupts poll(), then getch() gives KEY_RESIZE */
+		if (n < 0)
+			fail_if(errno != EINTR, "failed to wait for changes");
 
-				len -= sizeof(*ep) + ep->len;
-				p += sizeof(*ep) + ep->len;
-			}
-		} else if (FD_ISSET(STDIN_FILENO, &fds)) {
-			handle_key(getch());
-		} else {
-			abort();	// never reaches here
+		if (fds[1].revents) {
+			eventfd_t v;
+			eventfd_read(G.worker.wakefd, &v);
+			do_reload();
+			diag_take();
 		}
 
-		draw_screen();
+		for (int key; (key = getch()) != ERR;)
+			handle_key(key);
 
-		FD_ZERO(&fds);
-		FD_SET(watchfd, &fds);
-		FD_SET(STDIN_FILENO, &fds);
+		if (n) {
+			draw_screen();
+		} else {
+			search_step();
+		}
 	}
 
-	fail_if(ret < 0, "failed to wait for changes");
-do_exit:
-
-	return 0;
+	return G.err ? -1 : 0;
 }
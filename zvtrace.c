@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: MPL-2.0
+/*
+ *	zvtrace
+ *	Preloaded into the render by zviewer -t to report files it reads
+ *	Copyright (c) 2024 Yao Zi.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ *	The write end of the pipe zviewer reads reports from, given as
+ *	FD:DEV:INO so it's told apart from a file the render has opened with
+ *	the same number after closing it.
+ */
+static int traceFd = -1;
+static unsigned long long traceDev, traceIno;
+
+__attribute__((constructor)) static void
+trace_init(void)
+{
+	const char *fd = getenv("ZVIEWER_TRACE_FD");
+	if (!fd || sscanf(fd, "%d:%llu:%llu", &traceFd, &traceDev,
+			  &traceIno) != 3)
+		traceFd = -1;
+}
+
+static int
+trace_valid(void)
+{
+	struct stat st;
+	return !fstat(traceFd, &st) && S_ISFIFO(st.st_mode) &&
+	       st.st_dev == traceDev && st.st_ino == traceIno;
+}
+
+/* pseudo filesystems change all the time and affect no output */
+static int
+ignored(const char *path)
+{
+	return !strncmp(path, "/proc/", 6) || !strncmp(path, "/sys/", 5) ||
+	       !strncmp(path, "/dev/", 5);
+}
+
+/*
+ *	Report a successful read-only open of a regular file, as an absolute
+ *	path on a line. A line takes a single write no longer than PIPE_BUF,
+ *	so lines from processes of the render don't interleave.
+ */
+static void
+report(int dirfd, const char *path, int flags, int fd)
+{
+	if (traceFd < 0 || fd < 0 || (flags & O_ACCMODE) != O_RDONLY)
+		return;
+
+	int saved = errno;
+	char dir[PATH_MAX], line[PIPE_BUF];
+	struct stat st;
+	int n = -1;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		goto out;
+
+	if (path[0] == '/') {
+		n = snprintf(line, sizeof(line), "%s\n", path);
+	} else if (dirfd == AT_FDCWD) {
+		if (getcwd(dir, sizeof(dir)))
+			n = snprintf(line, sizeof(line), "%s/%s\n", dir, path);
+	} else {
+		char link[32];
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+
+		ssize_t len = readlink(link, dir, sizeof(dir) - 1);
+		if (len > 0) {
+			dir[len] = '\0';
+			n = snprintf(line, sizeof(line), "%s/%s\n", dir, path);
+		}
+	}
+
+	if (n > 0 && (size_t)n < sizeof(line) && !ignored(line) &&
+	    trace_valid())
+		write(traceFd, line, n);
+
+out:
+	errno = saved;
+}
+
+/* mode is only passed with O_CREAT or O_TMPFILE, which has O_DIRECTORY */
+#define OPEN_MODE(flags, mode) do {					\
+	if (((flags) & O_CREAT) || ((flags) & O_TMPFILE) == O_TMPFILE) {	\
+		va_list ap;						\
+		va_start(ap, flags);					\
+		mode = va_arg(ap, mode_t);				\
+		va_end(ap);						\
+	}								\
+} while (0)
+
+typedef int (*open_fn)(const char *, int, ...);
+typedef int (*openat_fn)(int, const char *, int, ...);
+typedef int (*open2_fn)(const char *, int);
+typedef int (*openat2_fn)(int, const char *, int);
+typedef FILE *(*fopen_fn)(const char *, const char *);
+
+#define REAL(name, type)						\
+	static type real;						\
+	if (!real)							\
+		*(void **)&real = dlsym(RTLD_NEXT, name)
+
+int
+open(const char *path, int flags, ...)
+{
+	REAL("open", open_fn);
+	mode_t mode = 0;
+	OPEN_MODE(flags, mode);
+
+	int fd = real(path, flags, mode);
+	report(AT_FDCWD, path, flags, fd);
+	return fd;
+}
+
+int
+open64(const char *path, int flags, ...)
+{
+	REAL("open64", open_fn);
+	mode_t mode = 0;
+	OPEN_MODE(flags, mode);
+
+	int fd = real(path, flags, mode);
+	report(AT_FDCWD, path, flags, fd);
+	return fd;
+}
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+	REAL("openat", openat_fn);
+	mode_t mode = 0;
+	OPEN_MODE(flags, mode);
+
+	int fd = real(dirfd, path, flags, mode);
+	report(dirfd, path, flags, fd);
+	return fd;
+}
+
+int
+openat64(int dirfd, const char *path, int flags, ...)
+{
+	REAL("openat64", openat_fn);
+	mode_t mode = 0;
+	OPEN_MODE(flags, mode);
+
+	int fd = real(dirfd, path, flags, mode);
+	report(dirfd, path, flags, fd);
+	return fd;
+}
+
+/* called instead of open() with _FORTIFY_SOURCE */
+int
+__open_2(const char *path, int flags)
+{
+	REAL("__open_2", open2_fn);
+
+	int fd = real(path, flags);
+	report(AT_FDCWD, path, flags, fd);
+	return fd;
+}
+
+int
+__open64_2(const char *path, int flags)
+{
+	REAL("__open64_2", open2_fn);
+
+	int fd = real(path, flags);
+	report(AT_FDCWD, path, flags, fd);
+	return fd;
+}
+
+int
+__openat_2(int dirfd, const char *path, int flags)
+{
+	REAL("__openat_2", openat2_fn);
+
+	int fd = real(dirfd, path, flags);
+	report(dirfd, path, flags, fd);
+	return fd;
+}
+
+int
+__openat64_2(int dirfd, const char *path, int flags)
+{
+	REAL("__openat64_2", openat2_fn);
+
+	int fd = real(dirfd, path, flags);
+	report(dirfd, path, flags, fd);
+	return fd;
+}
+
+/* stdio opens files without going through open() */
+FILE *
+fopen(const char *path, const char *mode)
+{
+	REAL("fopen", fopen_fn);
+
+	FILE *fp = real(path, mode);
+	if (fp && !strpbrk(mode, "wa+"))
+		report(AT_FDCWD, path, O_RDONLY, fileno(fp));
+	return fp;
+}
+
+FILE *
+fopen64(const char *path, const char *mode)
+{
+	REAL("fopen64", fopen_fn);
+
+	FILE *fp = real(path, mode);
+	if (fp && !strpbrk(mode, "wa+"))
+		report(AT_FDCWD, path, O_RDONLY, fileno(fp));
+	return fp;
+}